@@ -0,0 +1,130 @@
+#include "interpreter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Allocation test. Steps programs one step at a time and counts the calls
+   the engine makes to malloc, calloc, realloc and free, which are wrapped
+   at link time (-Wl,--wrap). Growth is only expected in two places: a step
+   that starts with more cursors than any step before it may grow the
+   cursor arrays, and a step that makes the field taller may grow the
+   field. Such a step is allowed up to GROWTH_CALLS heap calls. Every other
+   step runs with warm capacity and must not touch the heap at all; one
+   that does, such as a fork or a kill that allocates or frees a cursor,
+   is reported, and the exit status is 1.
+
+   Input is at end of file, so programs that read run without it.
+
+   Usage: alloctest [-n steps] program... */
+
+#define GROWTH_CALLS    8       /* heap calls allowed for a growth step */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+static long long calls;         /* heap calls since the start */
+
+void *__wrap_malloc(size_t size)
+{
+    calls += 1;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    calls += 1;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    calls += 1;
+    return __real_realloc(p, size);
+}
+
+void __wrap_free(void *p)
+{
+    if (p)
+        calls += 1;
+    __real_free(p);
+}
+
+/* Runs a program for up to `max_steps' steps. Returns the number of steps
+   that used the heap without cause. */
+static long long check(const char *filepath, long long max_steps)
+{
+    struct Interpreter *i;
+    long long steps, before, grown = 0, bad = 0;
+    int peak, height, growth, out;
+
+    i = interpreter_from_source(filepath, 0);
+    if (!i)
+    {
+        fprintf(stderr, "Could not open %s\n", filepath);
+        return 1;
+    }
+    peak = 0;
+    for (steps = 0; steps < max_steps && i->num_cursors > 0; ++steps)
+    {
+        growth = i->num_cursors > peak;
+        if (growth)
+            peak = i->num_cursors;
+        height = i->fld_sz.height;
+        before = calls;
+        if (interpreter_step(i, -1, &out) == I_ERROR)
+        {
+            fprintf(stderr, "%s: step %lld failed\n", filepath, steps + 1);
+            bad += 1;
+            break;
+        }
+        if (i->fld_sz.height > height)
+            growth = 1;
+        if (calls == before)
+            continue;
+        if (growth && calls - before <= GROWTH_CALLS)
+        {
+            grown += 1;
+            continue;
+        }
+        if (bad++ < 10)
+            fprintf(stderr, "%s: step %lld made %lld heap calls with %d "
+                    "cursors%s\n", filepath, steps + 1, calls - before,
+                    i->num_cursors, growth ? " while growing" : "");
+    }
+    printf("%s: %lld steps, up to %d cursors, %lld steps grew, "
+           "%lld other steps used the heap\n",
+           filepath, steps, peak, grown, bad);
+    interpreter_destroy(i);
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    long long max_steps = 1000000, bad = 0;
+    int ch, n;
+
+    while ((ch = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            max_steps = atoll(optarg);
+            if (max_steps < 1)
+            {
+                printf("-n expects a positive number of steps\n");
+                return 1;
+            }
+            break;
+        }
+    }
+    if (optind == argc)
+    {
+        printf("Usage: %s [-n steps] <program>...\n", argv[0]);
+        return argc != 1;
+    }
+    for (n = optind; n < argc; ++n)
+        bad += check(argv[n], max_steps);
+    return bad > 0;
+}
@@ -1,9 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <math.h>
 #include <string.h>
-#include <algorithm>
-#include <utility>
-#include <vector>
 
 #ifdef _MSC_VER     /* WIN32 */
 #include <getopt.h>
@@ -13,12 +12,13 @@
 #endif
 
 #include <FL/Fl.H>
-#include <FL/Fl_Output.H>
+#include <FL/Fl_Input.H>
 #include <FL/Fl_Window.H>
 #include <FL/Fl_Double_Window.H>
 #include <FL/Fl_Scroll.H>
 #include <FL/Fl_Group.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Toggle_Button.H>
 #include <FL/Fl_Scroll.H>
 #include <FL/fl_draw.H>
 
@@ -27,14 +27,45 @@
 
 const int SIZE = 20, FONT_SIZE = 15;
 const int FAST_STEPS = 10000;
+const int HISTORY_SIZE = 1 << 22;       /* undo log size, in ints */
+const int REPLAY_HISTORY = 10000;       /* steps logged at the end of a replay */
+const int MAX_CHECKPOINTS = 256;
+const int VISIT_BITS = 1 << 16;         /* visit bitmap size, per checkpoint */
 
 static Interpreter *initial, *i;
-static int i_in, i_out, i_steps;
+static long long epoch;     /* of the field as last drawn */
+static int breakpoints;
 static Size size;
 static class CellWidget **widgets;
 static Fl_Window *window;
 static Fl_Button *start_button, *fast_button, *step_button, *reset_button;
-static Fl_Output *counter;
+static Fl_Button *back_button, *rewind_button;
+static Fl_Toggle_Button *heat_button;
+static Fl_Input *counter;
+static long long heat_max;  /* most executions of a cell, while profiling */
+
+/* All input read so far, so that steps can be replayed, and the position
+   of the interpreter in it. Output is only written the first time. */
+static char *in_log;
+static long long in_size, in_cap, in_pos;
+static long long out_pos, out_done;
+static bool in_eof = false;
+
+/* Copies of the interpreter taken every checkpoint_interval steps. When
+   the table is full, every other checkpoint is dropped. Each has a bitmap
+   of the cells executed until the next one (see interpreter_set_visits()),
+   so that Rewind only needs to replay intervals that may hit a breakpoint.
+   The interpreter records into its own bitmap, which is added to that of
+   checkpoint visit_interval when it reaches the next one. */
+struct Checkpoint {
+    Interpreter *snap;
+    long long in_pos, out_pos;
+    unsigned char *visits;
+};
+static Checkpoint checkpoints[MAX_CHECKPOINTS];
+static int num_checkpoints;
+static long long checkpoint_interval = 1 << 16;
+static int visit_interval;
 static bool fast = false;
 static Fl_Scroll *cell_group;
 
@@ -67,6 +98,7 @@ public:
                  Fl::event_shift() && !Fl::event_ctrl() && !Fl::event_alt() )
             {
                 brk = !brk;
+                breakpoints += brk ? 1 : -1;
                 damage(1);
                 return 1;
             }
@@ -75,12 +107,29 @@ public:
         return 0;
     }
 
+    /* Returns the background colour, tinted red by how often the cell was
+       executed (on a logarithmic scale) while profiling. */
+    Fl_Color background()
+    {
+        CellCounts k;
+
+        if (brk)
+            return FL_YELLOW;
+        if (heat_max == 0 || !interpreter_get_counts(i, r, c, &k))
+            return FL_WHITE;
+        long long n = k.visits[0] + k.visits[1] + k.visits[2] + k.visits[3];
+        if (n == 0)
+            return FL_WHITE;
+        return fl_color_average(FL_RED, FL_WHITE,
+                                0.1f + 0.7f*log(1.0 + n)/log(1.0 + heat_max));
+    }
+
     void draw()
     {
         char buf[4];
-        int ch = interpreter_get(i, r, c);
+        int ch = r < interpreter_size(i).height ? interpreter_get(i, r, c) : 0;
 
-        fl_rectf(x(), y(), w(), h(), brk ? FL_YELLOW : FL_WHITE);
+        fl_rectf(x(), y(), w(), h(), background());
         if (border[0] == FL_BLACK)
             fl_rect(x(), y(), w(), h(), FL_BLACK);
         else
@@ -168,28 +217,13 @@ public:
 
 void decorate_cells()
 {
-    static std::vector< std::pair<Cursor*, Fl_Color> > cursor_color;
-    static int next_color = 0;
-
-    std::vector< std::pair<Cursor*, Fl_Color> >::iterator pos = cursor_color.begin();
-    for (Cursor *c = i->cursors; c; c = c->next)
+    for (int n = 0; n < i->num_cursors; ++n)
     {
-        std::vector< std::pair<Cursor*, Fl_Color> >::iterator it = pos;
-        while (it != cursor_color.end() && it->first != c) ++it;
-        if (it == cursor_color.end())
-        {
-            pos = cursor_color.insert(pos, std::make_pair(c, COLORS[next_color]));
-            if (++next_color == COLORS_SIZE) next_color = 0;
-        }
-        else
-        {
-            if (it != pos) std::rotate(pos, it, cursor_color.end());
-        }
-        Fl_Color col = pos++->second;
+        Cursor *c = &i->cursors[n];
+        Fl_Color col = COLORS[n % COLORS_SIZE];
         widgets[size.width * c->dr + c->dc]->addDataPointer(col);
         widgets[size.width * c->ir + c->ic]->addInstructionPointer(col, c->id);
     }
-    cursor_color.erase(pos, cursor_color.end());
 }
 
 void create_widgets(Size sz)
@@ -213,48 +247,312 @@ void create_widgets(Size sz)
 }
 
 
-void simulate_step(void *arg)
+/* Schedules the widgets of changed cells to be redrawn. */
+void cell_changed(void *arg, int r, int c)
 {
-    for (Cursor *c = i->cursors; c; c = c->next)
+    if (r >= size.height)
+        return;
+    if (c >= 0)
+        widgets[size.width*r + c]->damage(1);
+    else
+        for (c = 0; c < size.width; ++c)
+            widgets[size.width*r + c]->damage(1);
+}
+
+/* Reads more input from stdin. Returns false if none is available yet. */
+bool read_input()
+{
+    if (in_cap - in_size < 256)
     {
-        widgets[size.width * c->dr + c->dc]->clear();
-        widgets[size.width * c->ir + c->ic]->clear();
+        in_cap *= 2;
+        in_log = (char *)realloc(in_log, in_cap);
+        if (!in_log)
+            abort();
     }
+    ssize_t res = read(0, in_log + in_size, 256);
+#ifndef _MSC_VER
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+#endif
+    if (res > 0) in_size += res;
+    else in_eof = true;
+    return true;
+}
 
-    bool brk = false;
-    for (int n = 0; n < (fast ? FAST_STEPS : 1) && !brk; ++n)
+/* Writes the part of the output that was not written before. */
+void write_output(const char *buf, int len)
+{
+    out_pos += len;
+    if (out_pos > out_done)
     {
-        i_in = -1;
-        if (interpreter_needs_input(i))
+        int n = (int)(out_pos - out_done < len ? out_pos - out_done : len);
+        fwrite(buf + len - n, 1, n, stdout);
+        fflush(stdout);
+        out_done = out_pos;
+    }
+}
+
+/* Records a checkpoint at the current step, if it is due. */
+void take_checkpoint()
+{
+    Checkpoint *cp = &checkpoints[num_checkpoints - 1];
+
+    if (i->steps <= cp->snap->steps || i->steps % checkpoint_interval != 0)
+        return;
+    if (num_checkpoints == MAX_CHECKPOINTS)
+    {
+        for (int n = 1; n < MAX_CHECKPOINTS; ++n)
+            if (n%2)
+            {
+                /* Its interval now belongs to the one before */
+                unsigned char *visits = checkpoints[n/2].visits;
+                for (int k = 0; k < VISIT_BITS/8; ++k)
+                    visits[k] |= checkpoints[n].visits[k];
+                interpreter_destroy(checkpoints[n].snap);
+                free(checkpoints[n].visits);
+            }
+            else
+                checkpoints[n/2] = checkpoints[n];
+        num_checkpoints = MAX_CHECKPOINTS/2;
+        checkpoint_interval *= 2;
+        if (i->steps % checkpoint_interval != 0)
+            return;
+    }
+    cp = &checkpoints[num_checkpoints++];
+    cp->snap = interpreter_clone(i);
+    cp->visits = (unsigned char *)calloc(VISIT_BITS/8, 1);
+    if (!cp->snap || !cp->visits)
+        abort();
+    interpreter_set_flags(cp->snap, interpreter_get_flags(i) & ~F_JOURNAL);
+    cp->in_pos = in_pos;
+    cp->out_pos = out_pos;
+}
+
+/* Adds the cells executed by the interpreter to the bitmap of its
+   checkpoint interval. */
+void flush_visits()
+{
+    if (visit_interval < num_checkpoints)
+        interpreter_take_visits(i, checkpoints[visit_interval].visits);
+}
+
+/* Runs up to `steps' steps, reading input from stdin as it is needed.
+   Stops early when the program ends or no input is available yet. */
+void run_steps(long long steps)
+{
+    char out_buf[256];
+    int consumed, produced;
+    long long target = i->steps + steps;
+
+    while (i->steps < target)
+    {
+        long long next = (i->steps/checkpoint_interval + 1)*checkpoint_interval;
+        if (next > target)
+            next = target;
+        int status = interpreter_run(i, (int)(next - i->steps),
+                                     in_pos == in_size && in_eof ? NULL
+                                                                : in_log + in_pos,
+                                     (int)(in_size - in_pos),
+                                     out_buf, sizeof(out_buf),
+                                     &consumed, &produced);
+        in_pos += consumed;
+        write_output(out_buf, produced);
+        if (i->steps % checkpoint_interval == 0)
         {
-            char ch;
-            ssize_t res = read(0, &ch, 1);
-#ifndef _MSC_VER
-            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
-#endif
-            if (res > 0) i_in = ch & 0xff;
+            flush_visits();
+            take_checkpoint();
+            visit_interval = (int)(i->steps/checkpoint_interval);
         }
-        if (interpreter_step(i, i_in, &i_out) & I_OUTPUT)
+        if (status == I_EXIT || status == I_ERROR)
+            break;
+        if ((status & I_INPUT) && in_pos == in_size && !in_eof && !read_input())
+            break;
+    }
+}
+
+/* Undoes the last step. Returns false if it is not in the undo log. */
+bool undo_step()
+{
+    int status = interpreter_step_back(i);
+
+    if (status == I_ERROR)
+        return false;
+    if (status & I_INPUT)
+        in_pos -= 1;
+    if (status & I_OUTPUT)
+        out_pos -= 1;
+    return true;
+}
+
+/* Replaces the interpreter with a copy of checkpoint n. The execution
+   counts of the heat map start over from there. */
+void restore(int n)
+{
+    interpreter_destroy(i);
+    i = interpreter_clone(checkpoints[n].snap);
+    if (!i || !interpreter_set_visits(i, VISIT_BITS))
+        abort();
+    visit_interval = n;
+    interpreter_add_flags(i, F_JOURNAL);
+    if (heat_button && heat_button->value())
+        interpreter_set_profiling(i, 1);
+    in_pos = checkpoints[n].in_pos;
+    out_pos = checkpoints[n].out_pos;
+    epoch = 0;
+    cell_group->redraw();
+}
+
+/* Moves to step `target': backwards through the undo log if that is
+   shorter than replaying from the last checkpoint before it (or if the
+   log reaches that far), and forwards by running. Only the last steps of
+   a replay are logged, so the replay itself runs at full speed. */
+void go_to(long long target)
+{
+    int n = num_checkpoints - 1;
+
+    while (n > 0 && checkpoints[n].snap->steps > target)
+        --n;
+    if (i->steps - target <= target - checkpoints[n].snap->steps)
+        while (i->steps > target && undo_step())
+            ;
+    if (i->steps > target || target - i->steps > REPLAY_HISTORY)
+    {
+        if (i->steps > target || checkpoints[n].snap->steps > i->steps)
+            restore(n);
+        interpreter_set_history(i, 0);
+        run_steps(target - REPLAY_HISTORY - i->steps);
+        interpreter_set_history(i, HISTORY_SIZE);
+    }
+    run_steps(target - i->steps);
+}
+
+bool at_breakpoint()
+{
+    for (Cursor *c = i->cursors; c != i->cursors + i->num_cursors; ++c)
+        if ( c->ir < size.height && c->ic < size.width &&
+             widgets[size.width*c->ir + c->ic]->breakpoint() )
+            return true;
+    return false;
+}
+
+/* Returns whether a visit bitmap has any of the `count' bits set. */
+bool visited(const unsigned char *visits, const int *bits, int count)
+{
+    for (int n = 0; n < count; ++n)
+        if (visits[bits[n] >> 3] & 1 << (bits[n] & 7))
+            return true;
+    return false;
+}
+
+/* Goes back to the last step before the current one at which a cursor
+   was on a breakpoint, or to step 0 if there is none. Beyond the undo
+   log, the visit bitmaps of the checkpoint intervals show which ones may
+   contain such a step; only those are replayed step by step, latest
+   first, which is usually just the one with the breakpoint. */
+void run_back()
+{
+    while (undo_step())
+        if (at_breakpoint())
+            return;
+
+    int *bits = new int[breakpoints > 0 ? breakpoints : 1], count = 0;
+    for (int n = 0; n < size.width*size.height && count < breakpoints; ++n)
+        if (widgets[n]->breakpoint())
+            bits[count++] = interpreter_visit_bit(n/size.width, n%size.width,
+                                                  VISIT_BITS);
+    flush_visits();
+
+    long long end = i->steps, hit = -1;
+    int n = (int)((end - 1)/checkpoint_interval);
+    if (n >= num_checkpoints)
+        n = num_checkpoints - 1;
+    for (; end > 0 && n >= 0 && hit < 0; --n)
+    {
+        if (!visited(checkpoints[n].visits, bits, count))
+            continue;
+        long long stop = checkpoints[n].snap->steps + checkpoint_interval;
+        if (stop > end)
+            stop = end;
+        restore(n);
+        interpreter_set_history(i, 0);
+        while (i->steps < stop)
         {
-            fputc(i_out, stdout);
-            fflush(stdout);
+            if (at_breakpoint())
+                hit = i->steps;
+            long long steps = i->steps;
+            run_steps(1);
+            if (i->steps == steps)
+                break;
         }
-        ++i_steps;
-        for (Cursor *c = i->cursors; c; c = c->next)
-            if ( c->ir < size.height && c->id < size.width &&
-                 widgets[size.width*c->ir + c->ic]->breakpoint() )
-                brk = true;
     }
- 
-    char buf[16];
-    sprintf(buf, "%d", i_steps);
+    delete[] bits;
+    go_to(hit < 0 ? 0 : hit);
+}
+
+/* Finds the most executed cell, which sets the scale of the heat map, and
+   redraws all cells since any of them may change colour. */
+void update_heat()
+{
+    CellCounts k;
+
+    heat_max = 0;
+    for (int r = 0; r < size.height; ++r)
+        for (int c = 0; c < size.width; ++c)
+            if (interpreter_get_counts(i, r, c, &k))
+            {
+                long long n = k.visits[0] + k.visits[1] + k.visits[2] + k.visits[3];
+                if (n > heat_max)
+                    heat_max = n;
+            }
+    cell_group->redraw();
+}
+
+/* Updates the step counter and the cells after the interpreter ran. */
+void update_view()
+{
+    char buf[24];
+    sprintf(buf, "%lld", i->steps);
     counter->value(buf);
 
     Size sz = interpreter_size(i);
     if (sz.height > size.height)
+    {
         create_widgets(sz);
+        cell_group->redraw();
+    }
     decorate_cells();
-    cell_group->redraw();
+    epoch = interpreter_changes_since(i, epoch, cell_changed, 0);
+    if (epoch < 0)
+        cell_group->redraw();
+    if (heat_button->value())
+        update_heat();
+}
+
+void clear_cursors()
+{
+    for (Cursor *c = i->cursors; c != i->cursors + i->num_cursors; ++c)
+    {
+        widgets[size.width * c->dr + c->dc]->clear();
+        widgets[size.width * c->ir + c->ic]->clear();
+    }
+}
+
+void simulate_step(void *arg)
+{
+    clear_cursors();
+
+    bool brk = false;
+    if (fast && breakpoints == 0)
+        run_steps(FAST_STEPS);
+    else
+    for (int n = 0; n < (fast ? FAST_STEPS : 1) && !brk; ++n)
+    {
+        long long steps = i->steps;
+        run_steps(1);
+        if (i->steps == steps)
+            break;
+        brk = at_breakpoint();
+    }
+    update_view();
 
     if (arg == 0 && !brk)
         Fl::repeat_timeout(0.1, simulate_step);
@@ -271,35 +569,72 @@ void button_callback(Fl_Widget *widget, void *arg)
         Fl::add_timeout(0.1, simulate_step);
 }
 
+void back_callback(Fl_Widget *widget, void *arg)
+{
+    Fl::remove_timeout(simulate_step);
+    clear_cursors();
+    if (widget == rewind_button)
+        run_back();
+    else
+    if (i->steps > 0)
+        go_to(i->steps - 1);
+    update_view();
+}
+
+void goto_callback(Fl_Widget *widget, void *arg)
+{
+    Fl::remove_timeout(simulate_step);
+    clear_cursors();
+    long long target = strtoll(counter->value(), NULL, 10);
+    go_to(target < 0 ? 0 : target);
+    update_view();
+}
+
+void heat_callback(Fl_Widget *widget, void *arg)
+{
+    interpreter_set_profiling(i, heat_button->value());
+    update_heat();
+}
+
 void reset_callback(Fl_Widget *widget, void *arg)
 {
     Fl::remove_timeout(simulate_step);
-    interpreter_destroy(i);
-    i = interpreter_clone(initial);
-    i_steps = 0;
+    restore(0);
+    interpreter_set_history(i, HISTORY_SIZE);
     size.width = size.height = 0;
     counter->value("0");
     cell_group->clear();
     create_widgets(interpreter_size(i));
-    cell_group->redraw();
 }
 
 void run_debugger()
 {
-    window = new Fl_Double_Window(400, 300, "Refunge Debugger");
+    window = new Fl_Double_Window(450, 300, "Refunge Debugger");
     start_button = new Fl_Button(0, 0, 50, 25, "Slow");
     start_button->callback(button_callback);
     fast_button = new Fl_Button(50, 0, 50, 25, "Fast");
     fast_button->callback(button_callback);
     step_button = new Fl_Button(100, 0, 50, 25, "Step");
     step_button->callback(button_callback);
-    reset_button = new Fl_Button(150, 0, 50, 25, "Reset");
+    back_button = new Fl_Button(150, 0, 50, 25, "Back");
+    back_button->tooltip("Step back");
+    back_button->callback(back_callback);
+    rewind_button = new Fl_Button(200, 0, 50, 25, "Rewind");
+    rewind_button->tooltip("Run back to the previous breakpoint");
+    rewind_button->callback(back_callback);
+    reset_button = new Fl_Button(250, 0, 50, 25, "Reset");
     reset_button->callback(reset_callback);
-    counter = new Fl_Output(200, 0, 100, 25);
+    heat_button = new Fl_Toggle_Button(300, 0, 50, 25, "Heat");
+    heat_button->tooltip("Tint cells by how often they are executed");
+    heat_button->callback(heat_callback);
+    counter = new Fl_Input(350, 0, 100, 25);
+    counter->tooltip("Step number (enter a number to go to that step)");
+    counter->when(FL_WHEN_ENTER_KEY);
+    counter->callback(goto_callback);
     counter->value("0");
     window->end();
 
-    cell_group = new Fl_Scroll(0, 25, 400, 250);
+    cell_group = new Fl_Scroll(0, 25, 450, 250);
     cell_group->end();
     create_widgets(interpreter_size(i));
     decorate_cells();
@@ -351,9 +686,24 @@ int main(int argc, char *argv[])
     }
     if (clear_mode)
         interpreter_add_flags(initial, F_CLEAR_MODE);
+    interpreter_add_flags(initial, F_JOURNAL);
     i = interpreter_clone(initial);
+    interpreter_set_history(i, HISTORY_SIZE);
+    interpreter_set_visits(i, VISIT_BITS);
+    in_cap = 4096;
+    in_log = (char *)malloc(in_cap);
+    checkpoints[0].snap = initial;
+    checkpoints[0].visits = (unsigned char *)calloc(VISIT_BITS/8, 1);
+    num_checkpoints = 1;
     run_debugger();
     interpreter_destroy(i);
+    for (int n = 0; n < num_checkpoints; ++n)
+    {
+        if (n > 0)
+            interpreter_destroy(checkpoints[n].snap);
+        free(checkpoints[n].visits);
+    }
     interpreter_destroy(initial);
+    free(in_log);
     return 0;
 }
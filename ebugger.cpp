@@ -43,6 +43,12 @@ FTFont *font = 0;
 Interpreter *initial=0;
 Interpreter *ci=0;
 
+//display list per row of cells, recompiled when the row changes
+GLuint *row_lists=0;
+bool *row_dirty=0;
+int num_rows=0;
+long long epoch=0;
+
 class Color {
 	float r,g,b,a;
 
@@ -80,6 +86,8 @@ const Color hexColor = Color(.5f,.5f,1.0f);
 class DebugWindow : public Fl_Gl_Window {
   void draw();
 	void drawCell(char c);
+	void drawRow(int r);
+	void updateRows(int height);
 	void drawCursor(Cursor *c);
 	void worldToCell(int r, int c);
 	void init();
@@ -127,8 +135,23 @@ void DebugWindow::init() {
 		}
 
 		font->UseDisplayList(true);
+
+		//create the glyph display lists now, they can't be created while
+		//compiling the display list of a row
+		char glyphs[96] = {0};
+		for(int n=0;n<95;n++) glyphs[n] = 32+n;
+		glColorMask(GL_FALSE,GL_FALSE,GL_FALSE,GL_FALSE);
+		font->Render(glyphs);
+		glColorMask(GL_TRUE,GL_TRUE,GL_TRUE,GL_TRUE);
 	}
 
+	//display lists don't survive a new context
+	delete[] row_lists;
+	delete[] row_dirty;
+	row_lists=0;
+	row_dirty=0;
+	num_rows=0;
+
 
 	//enable wanted features
 	glEnable(GL_FOG);
@@ -190,23 +213,58 @@ void DebugWindow::draw() {
 	gluLookAt(ex,ey,ez,  tx,ty,tz,  0,0,1);
 
 	Size size = interpreter_size(ci);
+	updateRows(size.height);
 
 	for(int r=0;r<size.height;r++) {
-		int w = size.width;
-		while(w>0 && !interpreter_get(ci,r,w-1)) w--;
-		for(int c=0;c<w;c++) {
-			glPushMatrix();
-			worldToCell(r, c);
-			glTranslatef(0,0,cyl_radius);
-			drawCell(interpreter_get(ci,r,c));
-			glPopMatrix();
+		if(row_dirty[r]) {
+			glNewList(row_lists[r],GL_COMPILE);
+			drawRow(r);
+			glEndList();
+			row_dirty[r] = false;
+		}
+		glCallList(row_lists[r]);
+	}
+
+	for(int n=0;n<ci->num_cursors;n++) {
+		drawCursor(&ci->cursors[n]);
+	}
+}
+
+void DebugWindow::drawRow(int r) {
+	int w = interpreter_size(ci).width;
+	while(w>0 && !interpreter_get(ci,r,w-1)) w--;
+	for(int c=0;c<w;c++) {
+		glPushMatrix();
+		worldToCell(r, c);
+		glTranslatef(0,0,cyl_radius);
+		drawCell(interpreter_get(ci,r,c));
+		glPopMatrix();
+	}
+}
+
+void markRow(void *arg, int r, int c) {
+	if(r<num_rows) row_dirty[r] = true;
+}
+
+//allocates display lists for new rows and marks changed rows dirty
+void DebugWindow::updateRows(int height) {
+	if(height>num_rows) {
+		GLuint *lists = new GLuint[height];
+		bool *dirty = new bool[height];
+		for(int r=0;r<height;r++) {
+			lists[r] = r<num_rows ? row_lists[r] : glGenLists(1);
+			dirty[r] = r<num_rows ? row_dirty[r] : true;
 		}
+		delete[] row_lists;
+		delete[] row_dirty;
+		row_lists = lists;
+		row_dirty = dirty;
+		num_rows = height;
 	}
 
-	Cursor *cursor = ci->cursors;
-	while(cursor) {
-		drawCursor(cursor);
-		cursor = cursor->next;
+	epoch = interpreter_changes_since(ci,epoch,markRow,0);
+	if(epoch<0) {
+		for(int r=0;r<num_rows;r++) row_dirty[r] = true;
 	}
 }
 
@@ -392,11 +450,14 @@ int DebugWindow::handle_key() {
 			break;
 		case ' ':
 			{
-				int in=0,out=0;
+				int ch=EOF,consumed,produced;
+				char in,out;
 				if(interpreter_needs_input(ci)) {
-					in = fgetc(stdin);
+					ch = fgetc(stdin);
 				}
-			  if(interpreter_step(ci,in,&out) & I_OUTPUT) {
+				in = ch;
+				interpreter_run(ci,1,ch==EOF?NULL:&in,1,&out,1,&consumed,&produced);
+				if(produced) {
 					fputc(out,stdout);
 					fflush(stdout);
 				}
@@ -487,6 +548,7 @@ int main(int argc, char **argv) {
 	if(clearmode) {
 		interpreter_add_flags(initial, F_CLEAR_MODE);
 	}
+	interpreter_add_flags(initial, F_JOURNAL);
 
 	ci = interpreter_clone(initial);
 
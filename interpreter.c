@@ -1,8 +1,15 @@
 #include "interpreter.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
-#include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+/* With NO_STDIO (as for librefunge), functions that read or write files
+   are left out */
+#ifndef NO_STDIO
+#include <stdio.h>
+#endif
 
 #ifndef _MSC_VER
 #define INLINE __inline__
@@ -10,115 +17,605 @@
 #define INLINE
 #endif
 
+#if !defined(_MSC_VER) && !defined(NO_THREADS)
+#define USE_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef _MSC_VER
+#define USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Chunks shared between clones may be released from different threads */
+#ifdef __GNUC__
+#define REF_LOAD(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define REF_ADD(x, v)   __atomic_add_fetch(&(x), (v), __ATOMIC_ACQ_REL)
+#else
+#define REF_LOAD(x)     (x)
+#define REF_ADD(x, v)   ((x) += (v))
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(NO_AVX2)
+#define USE_AVX2
+#include <immintrin.h>
+#include <stddef.h>
+#endif
+
+/* Hot traces are compiled to machine code on x86-64 Linux; elsewhere, and
+   when code cannot be mapped, they run on a loop over their operations */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && \
+    !defined(NO_JIT)
+#define USE_JIT
+#endif
+
+/* Limits for loops executed in closed form (see skip_loop()) */
+#define LOOP_MAX_STEPS  1024    /* longest iteration traced */
+#define LOOP_MAX_WRITES 64      /* most cells written by an iteration */
+#define LOOP_MAX_READS  256     /* most cell reads in an iteration */
+#define LOOP_HINTS      256     /* size of the table of loops to retry later */
+
+/* Checkpoint file format (see interpreter_save()) */
+#define CHECKPOINT_MAGIC    "REFUNGE"
+#define CHECKPOINT_VERSION  2
+#define CHECKPOINT_ALIGN    4096    /* alignment of the field chunks */
+
+/* Number of cell changes kept individually by the journal (F_JOURNAL) */
+#define JOURNAL_SIZE    4096
+
+/* Most steps run by interpreter_run_stream() between writes of output */
+#define STREAM_STEPS    65536
+
+/* Smallest number of cursors worth handing to a separate thread */
+#ifndef MIN_CURSORS_PER_THREAD
+#define MIN_CURSORS_PER_THREAD 2048
+#endif
+
 #define IO_NONE    256
 #define IO_BLOCK   257
 
+/* Limits for compiled traces (see run_trace()) */
+#define TRACE_MAX_STEPS 4096    /* longest trace recorded */
+#define TRACE_MAX_OPS   1024    /* most data operations and branches */
+#define TRACE_MAX_SLOTS 128     /* most cells accessed by a trace */
+#define TRACE_MIN_STEPS 32      /* shortest trace worth compiling */
+#define TRACE_HOT       16      /* visits of a branch before it is recorded */
+#define TRACE_ENTRIES   4096    /* size of the table of hot states */
+#define TRACE_MARKS     65536   /* size of the set of cells on trace paths */
+
+/* Instruction pointer row of a cursor whose data pointer moved off the top */
+#define IR_DATA_TOP INT_MIN
+
 const int DR[4] = {  0, +1,  0, -1 };
 const int DC[4] = { +1,  0, -1,  0 };
 
-static INLINE char get(struct Interpreter *i, int row, int col)
+/* Instruction classes stored in the opcode plane. The four data pointer
+   moves are ordered like the direction tables DR and DC. */
+enum Opcode {
+    OP_NOP = 0,
+    OP_RIGHT, OP_DOWN, OP_LEFT, OP_UP, OP_HERE,
+    OP_NONE, OP_ADD, OP_SUBTRACT, OP_INPUT, OP_OUTPUT, OP_CLEAR,
+    OP_BACKSLASH, OP_SLASH, OP_BAR,
+    OP_JUMP, OP_BRANCH,
+    OP_FORK,
+    NUM_OPCODES
+};
+
+/* Instruction class of every character (a positional initializer, so that
+   compilers without C99 designated initializers can build it) */
+static const unsigned char OPCODE[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /*   ! " # $ % & ' ( ) * + , - . / */
+    0, OP_OUTPUT, 0, OP_JUMP, 0, 0, 0, 0, 0, 0, OP_CLEAR, OP_ADD, 0,
+    OP_SUBTRACT, 0, OP_SLASH,
+    /* 0 1 2 3 4 5 6 7 8 9 : ; < = > ? */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, OP_LEFT, 0, OP_RIGHT, OP_INPUT,
+    /* @ A B C D E F G H I J K L M N O */
+    OP_BRANCH, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* P Q R S T U V W X Y Z [ \ ] ^ _ */
+    0, 0, 0, 0, 0, 0, 0, 0, OP_HERE, OP_FORK, 0, 0, OP_BACKSLASH, 0, OP_UP, 0,
+    /* ` a b c d e f g h i j k l m n o */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* p q r s t u v w x y z { | } ~ */
+    0, 0, 0, 0, 0, 0, OP_DOWN, 0, 0, 0, 0, 0, OP_BAR, 0, OP_NONE, 0
+};
+
+/* State collected while running a range of cursors. Each thread running
+   cursors has its own, so the run phase writes no shared data. */
+struct Run {
+    struct Cursor *out;         /* cursors for the next step */
+    int num_out;
+    struct Effect *effects;     /* data effects, in cursor order */
+    int num_effects;
+    int inputs, clears;         /* number of E_INPUT and E_CLEAR effects */
+    int output;                 /* character, IO_NONE or IO_BLOCK */
+    int height;                 /* field height needed by the data pointers */
+    int mask;                   /* hash table size - 1, or 0 to not merge */
+    int waiting;                /* cursors in input mode (with merging) */
+    int late;                   /* a cursor may have left the bottom */
+    int forks, merges;
+    int kills[NUM_KILLS];       /* cursors removed, by rule */
+};
+
+/* Changes to the field, recorded with F_JOURNAL. The last JOURNAL_SIZE
+   changed cells are kept in a ring; beyond that, only the epoch of the
+   last change to each row is known. */
+struct Journal {
+    long long epoch;            /* number of changes recorded */
+    struct { int row, col; } cells[JOURNAL_SIZE];
+    long long *rows;            /* per row: epoch after its last change */
+    int num_rows;
+};
+
+/* Undo log (see interpreter_set_history()): a ring of ints with a record
+   per step. A record holds its length, the field height, the I_INPUT and
+   I_OUTPUT flags of the step, its input and a cursor count, then the row
+   and column (shifted left by 8, with the old value in the low byte) of
+   every cell the step changed, and finally its length again so that
+   records can be walked backwards. Only snapshots, the records of steps
+   that start at a multiple of UNDO_INTERVAL steps or in an empty log, hold
+   the cursors and the engine counters from before the step, after the
+   cursor count; other records have a count of -1. A step is undone from
+   the last snapshot, by running the steps after it again. The oldest
+   records are dropped to make room for new ones, up to the next
+   snapshot. */
+#define UNDO_HEADER     5
+#define UNDO_CURSOR     5
+#define UNDO_STATS      ((int)(sizeof(struct Stats)/sizeof(int)))
+#define UNDO_INTERVAL   32      /* steps from one snapshot to the next */
+
+struct History {
+    int *ring;
+    int size;                   /* in ints */
+    long long head, tail;       /* start of the oldest record, end of ring */
+    long long start;            /* start of the record being written */
+    int snapshot;               /* the record being written is a snapshot */
+    int overflow;               /* the record being written does not fit */
+};
+
+/* Execution counts (see interpreter_set_profiling()) of the cells in rows
+   [0, height) of a field `width' cells wide, and their totals per row. */
+struct Profile {
+    int width, height, cap;
+    struct CellCounts *cells;   /* row-major */
+    struct CellCounts *rows;
+};
+
+/* The field is stored in chunks of CHUNK_ROWS rows. Each chunk holds the
+   cells of its rows, fld_cap.width bytes per row, followed by the opcode
+   plane for those cells (at offset PLANE). */
+#define CHUNK_SHIFT     4
+#define CHUNK_ROWS      (1 << CHUNK_SHIFT)
+#define PLANE(i)        (CHUNK_ROWS*(i)->fld_cap.width)
+
+/* With F_TILED, the cells in a chunk are stored in tiles of TILE x TILE
+   cells (one cache line), ordered left to right in bands of TILE rows, so
+   that vertical neighbours usually share a cache line. */
+#define TILE_SHIFT      3
+#define TILE            (1 << TILE_SHIFT)
+
+/* Returns the offset of cell (row, col) within its chunk. */
+static INLINE int chunk_offset(int width, int tiled, int row, int col)
+{
+    row &= CHUNK_ROWS - 1;
+    if (tiled)
+        return (row >> TILE_SHIFT)*TILE*width + (col >> TILE_SHIFT)*TILE*TILE +
+               (row & (TILE - 1))*TILE + (col & (TILE - 1));
+    return row*width + col;
+}
+
+/* Chunks are reference counted, so that an interpreter and its clones
+   share them until one of them writes to a chunk (see writable()). The
+   count is kept in a header in front of the chunk data. */
+#define CHUNK_HEADER    16
+
+static INLINE long *chunk_refs(char *chunk)
+{
+    return (long *)(chunk - CHUNK_HEADER);
+}
+
+/* Allocates a zeroed chunk of `size' bytes with a reference count of 1. */
+static char *chunk_alloc(size_t size)
+{
+    char *chunk = calloc(CHUNK_HEADER + size, 1);
+
+    if (!chunk)
+        return NULL;
+    *(long *)chunk = 1;
+    return chunk + CHUNK_HEADER;
+}
+
+/* Chunks loaded from a checkpoint live in the file image, which is shared
+   by the interpreter and its clones and counted in its Mapping. Their
+   headers in the image are left as written, with a reference count of 0,
+   so that loading and cloning touch no page of the image: such a chunk is
+   never counted or freed, and always copied before writing. */
+struct Mapping {
+    long refs;
+    char *addr;
+    size_t size;
+    int mapped;                 /* addr was mapped, rather than allocated */
+};
+
+static void mapping_release(struct Mapping *m)
+{
+    if (!m || REF_ADD(m->refs, -1) != 0)
+        return;
+#ifdef USE_MMAP
+    if (m->mapped)
+        munmap(m->addr, m->size);
+    else
+#endif
+        free(m->addr);
+    free(m);
+}
+
+static void chunk_release(char *chunk)
+{
+    if (chunk && REF_LOAD(*chunk_refs(chunk)) != 0 &&
+        REF_ADD(*chunk_refs(chunk), -1) == 0)
+        free(chunk - CHUNK_HEADER);
+}
+
+static INLINE char *cell(struct Interpreter *i, int row, int col)
 {
     assert(row >= 0 && row < i->fld_sz.height &&
            col >= 0 && col < i->fld_sz.width);
-    return i->field[i->fld_cap.width*row + col];
+    return i->chunks[row >> CHUNK_SHIFT] +
+           chunk_offset(i->fld_cap.width, i->flags & F_TILED, row, col);
+}
+
+static INLINE char get(struct Interpreter *i, int row, int col)
+{
+    return *cell(i, row, col);
+}
+
+static INLINE int op(struct Interpreter *i, int row, int col)
+{
+    return (unsigned char)cell(i, row, col)[PLANE(i)];
+}
+
+/* Makes chunk n private to this interpreter, copying it if a clone still
+   shares it or it lives in a checkpoint image. */
+static void unshare(struct Interpreter *i, int n)
+{
+    char *chunk;
+
+    if (REF_LOAD(*chunk_refs(i->chunks[n])) != 1)
+    {
+        chunk = chunk_alloc(2*PLANE(i));
+        assert(chunk);
+        memcpy(chunk, i->chunks[n], 2*PLANE(i));
+        chunk_release(i->chunks[n]);
+        i->chunks[n] = chunk;
+    }
+    i->shared[n] = 0;
+}
+
+/* Returns cell (row, col) for writing. */
+static INLINE char *writable(struct Interpreter *i, int row, int col)
+{
+    if (i->shared[row >> CHUNK_SHIFT])
+        unshare(i, row >> CHUNK_SHIFT);
+    return cell(i, row, col);
+}
+
+/* Whether an instruction class moves the data pointer (and so reads
+   input for a cursor in input mode) */
+#define MOVES_DATA(code) ((unsigned)((code) - OP_RIGHT) <= OP_HERE - OP_RIGHT)
+
+/* Stores the instruction class of a cell. When a cell turns into or stops
+   being a no-op, the instruction count of its chunk changes and its no-op
+   run lengths become stale. When it turns into or stops being a data
+   pointer move, a cursor on it may start or stop reading input, so the
+   readers are counted again when next needed. When a cell on the path of a
+   compiled trace changes class, traces check their paths again. */
+struct TraceCache;
+static int on_trace_path(struct TraceCache *tc, int row, int col);
+
+static INLINE void set_op(struct Interpreter *i, char *p, int row, int col)
+{
+    int code = OPCODE[(unsigned char)p[0]];
+
+    if ((p[PLANE(i)] == OP_NOP) != (code == OP_NOP))
+    {
+        i->stale[row >> CHUNK_SHIFT] = 1;
+        i->insns[row >> CHUNK_SHIFT] += code == OP_NOP ? -1 : 1;
+    }
+    if (MOVES_DATA(p[PLANE(i)]) != MOVES_DATA(code))
+        i->readers = -1;
+    if (p[PLANE(i)] != code && i->traces &&
+        on_trace_path(i->traces, row, col))
+        i->op_changes += 1;
+    p[PLANE(i)] = code;
+}
+
+/* Records a change to cell (row, col) in the journal. */
+static void record(struct Journal *j, int row, int col)
+{
+    int n = (int)(j->epoch % JOURNAL_SIZE);
+
+    j->cells[n].row = row;
+    j->cells[n].col = col;
+    j->epoch += 1;
+    j->rows[row] = j->epoch;
+}
+
+/* Appends a value to the record being written to the undo log, dropping
+   older records if needed. The oldest record left is a snapshot. */
+static void undo_push(struct History *h, int value)
+{
+    if (h->overflow)
+        return;
+    if (h->tail - h->head == h->size)
+    {
+        do
+        {
+            if (h->head == h->start)
+            {
+                h->overflow = 1;
+                return;
+            }
+            h->head += h->ring[h->head % h->size];
+        }
+        while (h->head != h->start && h->ring[(h->head + 4) % h->size] < 0);
+        if (h->head == h->start && !h->snapshot)
+        {
+            h->overflow = 1;
+            return;
+        }
+    }
+    h->ring[h->tail++ % h->size] = value;
 }
 
 static INLINE void set(struct Interpreter *i, int row, int col, char value)
 {
-    assert(row >= 0 && row < i->fld_sz.height &&
-           col >= 0 && col < i->fld_sz.width);
-    i->field[i->fld_cap.width*row + col] = value;
+    char *p = writable(i, row, col);
+
+    if (i->history && p[0] != value)
+    {
+        undo_push(i->history, row);
+        undo_push(i->history, col << 8 | (unsigned char)p[0]);
+    }
+    if (i->journal && p[0] != value)
+        record(i->journal, row, col);
+    p[0] = value;
+    set_op(i, p, row, col);
 }
 
 static INLINE void add(struct Interpreter *i, int row, int col, int value)
 {
-    assert(row >= 0 && row < i->fld_sz.height &&
-           col >= 0 && col < i->fld_sz.width);
-    i->field[i->fld_cap.width*row + col] += value;
+    char *p = writable(i, row, col);
+
+    if (i->history && (char)value != 0)
+    {
+        undo_push(i->history, row);
+        undo_push(i->history, col << 8 | (unsigned char)p[0]);
+    }
+    if (i->journal && (char)value != 0)
+        record(i->journal, row, col);
+    p[0] += value;
+    set_op(i, p, row, col);
 }
 
 static INLINE int cursor_needs_input(struct Interpreter *i, struct Cursor *c)
 {
     if (c->dm != M_INPUT)
         return 0;
-    switch (get(i, c->ir, c->ic))
+    switch (op(i, c->ir, c->ic))
     {
-    case '^':
+    case OP_UP:
         return c->dr != 0;
-    case '>':
-    case '<':
-    case 'v':
-    case 'X':
+    case OP_RIGHT:
+    case OP_LEFT:
+    case OP_DOWN:
+    case OP_HERE:
         return 1;
     default:
         return 0;
     }
 }
 
-/* Ensures the field size is at least height x width, and reallocates
-   the field buffer if necessary. */
+/* Counts the cursors whose next step reads input. */
+static int count_readers(struct Interpreter *i)
+{
+    int n, count = 0;
+
+    for (n = 0; n < i->num_cursors; ++n)
+        count += cursor_needs_input(i, &i->cursors[n]);
+    return count;
+}
+
+/* Changes the row length of all chunks to `width' bytes. Rows (or with
+   F_TILED, bands of tiles) keep their data at the start. */
+static void widen(struct Interpreter *i, int width)
+{
+    char *chunk;
+    int n, r, old = i->fld_cap.width, rows = i->flags & F_TILED ? TILE : 1;
+
+    for (n = 0; n < i->num_chunks; ++n)
+    {
+        chunk = chunk_alloc(2*CHUNK_ROWS*width);
+        assert(chunk);
+        for (r = 0; r < 2*CHUNK_ROWS; r += rows)
+            memcpy(chunk + width*r, i->chunks[n] + old*r, old*rows);
+        chunk_release(i->chunks[n]);
+        i->chunks[n] = chunk;
+        i->shared[n] = 0;
+        free(i->nops[n]);
+        i->nops[n] = NULL;
+    }
+    i->stats.reallocs += 1;
+    i->stats.bytes_copied += (long long)i->num_chunks*2*CHUNK_ROWS*old;
+    i->fld_cap.width = width;
+}
+
+/* Converts all chunks to the row-major or tiled layout. */
+static void relayout(struct Interpreter *i, int tiled)
+{
+    char *chunk;
+    int n, r, c, from, to, width = i->fld_cap.width;
+
+    for (n = 0; n < i->num_chunks; ++n)
+    {
+        chunk = chunk_alloc(2*PLANE(i));
+        assert(chunk);
+        for (r = 0; r < CHUNK_ROWS; ++r)
+            for (c = 0; c < width; ++c)
+            {
+                from = chunk_offset(width, i->flags & F_TILED, r, c);
+                to = chunk_offset(width, tiled, r, c);
+                chunk[to] = i->chunks[n][from];
+                chunk[PLANE(i) + to] = i->chunks[n][PLANE(i) + from];
+            }
+        chunk_release(i->chunks[n]);
+        i->chunks[n] = chunk;
+        i->shared[n] = 0;
+    }
+}
+
+/* Makes room in the journal for the epochs of all rows in the field. */
+static int journal_rows(struct Journal *j, int height)
+{
+    long long *rows;
+
+    if (height <= j->num_rows)
+        return 1;
+    rows = realloc(j->rows, height*sizeof(long long));
+    if (!rows)
+        return 0;
+    memset(rows + j->num_rows, 0, (height - j->num_rows)*sizeof(long long));
+    j->rows = rows;
+    j->num_rows = height;
+    return 1;
+}
+
+/* Starts (or with enable = 0, stops) recording changes to the field. */
+static int journal(struct Interpreter *i, int enable)
+{
+    if (!enable)
+    {
+        if (i->journal)
+            free(i->journal->rows);
+        free(i->journal);
+        i->journal = NULL;
+        return 1;
+    }
+    if (i->journal)
+        return 1;
+    i->journal = malloc(sizeof(struct Journal));
+    if (!i->journal)
+        return 0;
+    i->journal->epoch = 0;
+    i->journal->rows = NULL;
+    i->journal->num_rows = 0;
+    if (!journal_rows(i->journal, i->fld_cap.height))
+    {
+        journal(i, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/* Ensures the field size is at least height x width. Growing the height
+   appends zeroed chunks and never moves existing rows; growing the width
+   (which only happens while a program is loaded) moves all rows. */
 static void ensure(struct Interpreter *i, int height, int width)
 {
-    if (width > i->fld_cap.width || height > i->fld_cap.height)
-    {
-        struct Size cap = i->fld_cap;
-        char *f;
-        int r, c;
-
-        if (cap.width == 0)
-            cap.width = 16;
-        while (cap.width < width)
-            cap.width *= 2;
-        if (cap.height == 0)
-            cap.height = 16;
-        while (cap.height < height)
-            cap.height *= 2;
-        f = malloc(cap.width * cap.height);
-        assert(f);
-        memset(f, 0, cap.width * cap.height);
-        for (r = 0; r < i->fld_cap.height; ++r)
-            for (c = 0; c < i->fld_cap.width; ++c)
-                f[cap.width*r + c] = i->field[i->fld_cap.width*r + c];
-        free(i->field);
-        i->field = f;
-        i->fld_cap = cap;
+    if (width > i->fld_cap.width)
+    {
+        int cap = i->fld_cap.width ? i->fld_cap.width : 16;
+
+        while (cap < width)
+            cap *= 2;
+        widen(i, cap);
+    }
+
+    while (height > i->fld_cap.height)
+    {
+        if (i->num_chunks == i->cap_chunks)
+        {
+            i->cap_chunks = i->cap_chunks ? 2*i->cap_chunks : 4;
+            i->chunks = realloc(i->chunks, i->cap_chunks*sizeof(char *));
+            i->nops = realloc(i->nops, i->cap_chunks*sizeof(unsigned char *));
+            i->stale = realloc(i->stale, i->cap_chunks);
+            i->insns = realloc(i->insns, i->cap_chunks*sizeof(int));
+            i->shared = realloc(i->shared, i->cap_chunks);
+            assert(i->chunks && i->nops && i->stale && i->insns && i->shared);
+            i->stats.reallocs += 1;
+            i->stats.bytes_copied += (long long)i->num_chunks*
+                (sizeof(char *) + sizeof(unsigned char *) + sizeof(int) + 2);
+        }
+        i->chunks[i->num_chunks] = chunk_alloc(2*PLANE(i));
+        assert(i->chunks[i->num_chunks]);
+        i->shared[i->num_chunks] = 0;
+        i->nops[i->num_chunks] = NULL;
+        i->stale[i->num_chunks] = 1;
+        i->insns[i->num_chunks] = 0;
+        i->num_chunks += 1;
+        i->fld_cap.height += CHUNK_ROWS;
+    }
+    if (i->journal && !journal_rows(i->journal, i->fld_cap.height))
+    {
+        /* Stop recording rather than record rows past the end */
+        journal(i, 0);
+        i->flags &= ~F_JOURNAL;
     }
 
     if (width > i->fld_sz.width)
+    {
         i->fld_sz.width = width;
+        memset(i->stale, 1, i->num_chunks);
+    }
     if (height > i->fld_sz.height)
         i->fld_sz.height = height;
 }
 
-static void set_effect(struct Interpreter *i, struct Cursor *c)
+/* Returns the data effect of the cursor at `c' for the cell its data
+   pointer is about to leave. Output is merged into `r' right away. */
+static int data_effect(struct Interpreter *i, struct Run *r, struct Cursor *c)
 {
     switch(c->dm)
     {
     case M_NONE:
         break;
     case M_ADD:
-        c->effect = E_ADD | ((+get(i, c->dr, c->dc))&0xff);
-        break;
+        return E_ADD | ((+c->weight*get(i, c->dr, c->dc))&0xff);
     case M_SUBTRACT:
-        c->effect = E_ADD | ((-get(i, c->dr, c->dc))&0xff);
-        break;
+        return E_ADD | ((-c->weight*get(i, c->dr, c->dc))&0xff);
     case M_INPUT:
-        c->effect = E_INPUT;
-        break;
+        return E_INPUT;
     case M_OUTPUT:
         {
             int ch = get(i, c->dr, c->dc);
-            if (i->output == IO_NONE)
-                i->output = ch;
+            if (r->output == IO_NONE)
+                r->output = ch;
             else
-            if (i->output != ch)
-                i->output = IO_BLOCK;
+            if (r->output != ch)
+                r->output = IO_BLOCK;
             break;
         }
     case M_CLEAR:
-        c->effect = E_CLEAR;
-        break;
+        return E_CLEAR;
     }
+    return 0;
+}
+
+/* Records a data effect on cell (row, col). */
+static INLINE void push_effect(struct Run *r, int row, int col, int effect)
+{
+    struct Effect *e = &r->effects[r->num_effects++];
+
+    e->row = row;
+    e->col = col;
+    e->effect = effect;
+    r->inputs += effect == E_INPUT;
+    r->clears += effect == E_CLEAR;
 }
 
 static void move_ip(struct Interpreter *i, struct Cursor *c)
@@ -131,196 +628,2421 @@ static void move_ip(struct Interpreter *i, struct Cursor *c)
         c->ic -= i->fld_sz.width;
 }
 
-static struct Cursor **kill_cursor(struct Cursor **ptr)
+/* Ensures both cursor arrays can hold at least `count' cursors. The arrays
+   only grow, so once a program reaches its peak cursor count no further
+   allocations take place. */
+static int reserve_cursors(struct Interpreter *i, int count)
+{
+    struct Cursor *a, *b;
+    struct Effect *effects;
+    int cap, *slots, *waiting;
+
+    if (count <= i->cap_cursors)
+        return 1;
+    cap = i->cap_cursors ? i->cap_cursors : 16;
+    while (cap < count)
+        cap *= 2;
+    a = realloc(i->cursors, cap*sizeof(struct Cursor));
+    if (!a)
+        return 0;
+    i->cursors = a;
+    b = realloc(i->spare, cap*sizeof(struct Cursor));
+    if (!b)
+        return 0;
+    i->spare = b;
+    effects = realloc(i->effects, cap*sizeof(struct Effect));
+    if (!effects)
+        return 0;
+    i->effects = effects;
+    slots = realloc(i->slots, 2*cap*sizeof(int));
+    if (!slots)
+        return 0;
+    i->slots = slots;
+    waiting = realloc(i->waiting, cap*sizeof(int));
+    if (!waiting)
+        return 0;
+    i->waiting = waiting;
+    i->cap_cursors = cap;
+    return 1;
+}
+
+/* Hashes the part of a cursor's state that determines its behaviour. */
+static INLINE unsigned cursor_hash(const struct Cursor *c)
 {
-    struct Cursor *c = *ptr;
-    *ptr = c->next;
-    free(c);
-    return ptr;
+    unsigned h;
+
+    h = (unsigned)c->ir*0x9e3779b1u ^ (unsigned)c->ic;
+    h = h*0x9e3779b1u ^ (unsigned)c->dr;
+    h = h*0x9e3779b1u ^ (unsigned)c->dc;
+    h = h*0x9e3779b1u ^ (unsigned)(c->id << 8 | c->dm);
+    return h ^ h >> 15;
+}
+
+static INLINE int same_cursor(const struct Cursor *a, const struct Cursor *b)
+{
+    return a->ir == b->ir && a->ic == b->ic && a->dr == b->dr &&
+           a->dc == b->dc && a->id == b->id && a->dm == b->dm;
 }
 
-static struct Cursor **fork_cursor(struct Interpreter *i, struct Cursor **ptr)
+/* Adds the cursor at `c' to the cursors for the next step, unless it has
+   died. With r->mask set, a cursor in the same state as an earlier one is
+   merged into it instead (unless F_NO_MERGE is set): they behave
+   identically from now on, so one cursor can stand in for both if its data
+   effects are multiplied by its weight. `c' may point into r->out at or
+   after the next free entry. */
+static INLINE void keep(struct Interpreter *i, struct Run *r, struct Cursor *c)
 {
-    struct Cursor *b = malloc(sizeof(struct Cursor)), *c = *ptr;
-    assert(b);
-    *b = *c;
-    b->next = c;
-    *ptr = b;
-    b->id ^= 1;
-    c->id ^= 3;
-    move_ip(i, b);
-    return &b->next;
+    struct Cursor *next;
+    int n, slot;
+
+    if (c->ir < 0)
+    {
+        r->kills[c->ir == IR_DATA_TOP ? K_DATA_TOP : K_IP_TOP] += 1;
+        return;
+    }
+    if (r->mask != 0)
+    {
+        if (!(i->flags & F_NO_MERGE))
+        {
+            for (slot = cursor_hash(c) & r->mask; (n = i->slots[slot]) != 0;
+                 slot = (slot + 1) & r->mask)
+            {
+                if (same_cursor(&r->out[n - 1], c))
+                {
+                    r->out[n - 1].weight += c->weight;
+                    r->merges += 1;
+                    return;
+                }
+            }
+            i->slots[slot] = r->num_out + 1;
+        }
+        if (c->ir >= r->height)
+            r->late = 1;
+        if (c->dm == M_INPUT)
+            i->waiting[r->waiting++] = r->num_out;
+    }
+    next = &r->out[r->num_out++];
+    if (next != c)
+        *next = *c;
 }
 
-/* Executes a single instruction and returns a pointer to
-   a pointer to the next cursor. */
-static struct Cursor **run_cursor(struct Interpreter *i, struct Cursor **ptr)
+/* Forks the cursor at `c' into two: the new cursor stays at `c' (and is
+   moved like any other cursor), its parent is moved to c + 1. */
+static void fork_cursor(struct Interpreter *i, struct Cursor *c)
 {
-    struct Cursor *c = *ptr;
+    c[1] = *c;
+    c[1].id ^= 3;
+    move_ip(i, &c[1]);
+    c->id ^= 1;
+}
+
+/* Instruction dispatch. With GCC-compatible compilers each opcode jumps
+   straight to its handler through a table of label addresses (computed
+   goto); elsewhere this falls back to an ordinary switch statement. */
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define THREADED_DISPATCH
+#define DISPATCH(x)     goto *handlers[x];
+#define CASE(x)         L_##x:
+#else
+#define DISPATCH(x)     switch (x)
+#define CASE(x)         case x:
+#endif
+#define NEXT            goto move
 
-    /* Reset field effect */
-    c->effect = 0;
+/* Executes a single instruction for the cursor at `c'. A cursor whose data
+   pointer moves off the top gets IP row IR_DATA_TOP so it is removed later. The
+   field itself is not modified; data effects and growth are recorded in `r'
+   instead. Returns the number of cursors at `c' afterwards (2 for a fork). */
+static int run_cursor(struct Interpreter *i, struct Run *r, struct Cursor *c)
+{
+#ifdef THREADED_DISPATCH
+    static const void *const handlers[NUM_OPCODES] = {
+        &&L_OP_NOP,
+        &&L_OP_RIGHT, &&L_OP_DOWN, &&L_OP_LEFT, &&L_OP_UP, &&L_OP_HERE,
+        &&L_OP_NONE, &&L_OP_ADD, &&L_OP_SUBTRACT, &&L_OP_INPUT,
+        &&L_OP_OUTPUT, &&L_OP_CLEAR,
+        &&L_OP_BACKSLASH, &&L_OP_SLASH, &&L_OP_BAR,
+        &&L_OP_JUMP, &&L_OP_BRANCH,
+        &&L_OP_FORK };
+#endif
+    int effect = 0, count = 1;
 
     /* Evaluate instruction */
-    switch (get(i, c->ir, c->ic))
+    DISPATCH(op(i, c->ir, c->ic))
     {
+    CASE(OP_NOP)
+        NEXT;
+
         /* Move data pointer */
-    case '>':
-        set_effect(i, c);
+    CASE(OP_RIGHT)
+        effect = data_effect(i, r, c);
         if (++c->dc == i->fld_sz.width)
             c->dc = 0;
-        break;
-    case 'v':
-        set_effect(i, c);
-        if (++c->dr == i->fld_sz.height)
-            ensure(i, c->dr + 1, 0);
-        break;
-    case '<':
-        set_effect(i, c);
+        goto data;
+    CASE(OP_DOWN)
+        effect = data_effect(i, r, c);
+        if (++c->dr == r->height)
+            r->height = c->dr + 1;
+        goto data;
+    CASE(OP_LEFT)
+        effect = data_effect(i, r, c);
         if (c->dc-- == 0)
             c->dc = i->fld_sz.width - 1;
-        break;
-    case '^':
+        goto data;
+    CASE(OP_UP)
         if (c->dr == 0)
-            return kill_cursor(ptr);
-        set_effect(i, c);
+        {
+            c->ir = IR_DATA_TOP;
+            return 1;
+        }
+        effect = data_effect(i, r, c);
         --c->dr;
-        break;
-    case 'X':
-        set_effect(i, c);
-        break;
+        goto data;
+    CASE(OP_HERE)
+        effect = data_effect(i, r, c);
+        goto data;
 
         /* Change data mode */
-    case '~': c->dm = M_NONE; break;
-    case '+': c->dm = M_ADD; break;
-    case '-': c->dm = M_SUBTRACT; break;
-    case '?': c->dm = M_INPUT; break;
-    case '!': c->dm = M_OUTPUT; break;
-    case '*':
+    CASE(OP_NONE)     c->dm = M_NONE; NEXT;
+    CASE(OP_ADD)      c->dm = M_ADD; NEXT;
+    CASE(OP_SUBTRACT) c->dm = M_SUBTRACT; NEXT;
+    CASE(OP_INPUT)    c->dm = M_INPUT; NEXT;
+    CASE(OP_OUTPUT)   c->dm = M_OUTPUT; NEXT;
+    CASE(OP_CLEAR)
         if (i->flags & F_CLEAR_MODE)
             c->dm = M_CLEAR;
-        break;
+        NEXT;
 
         /* Change instruction pointer direction */
-    case '\\': c->id ^= 1; break;
-    case '/' : c->id ^= 3; break;
-    case '|' : c->id ^= 2; break;
+    CASE(OP_BACKSLASH) c->id ^= 1; NEXT;
+    CASE(OP_SLASH)     c->id ^= 3; NEXT;
+    CASE(OP_BAR)       c->id ^= 2; NEXT;
 
         /* Jumps */
-    case '#':
+    CASE(OP_JUMP)
         move_ip(i, c);
-        break;
-    case '@':
+        NEXT;
+    CASE(OP_BRANCH)
         if (get(i, c->dr, c->dc) == 0)
         {
             c->ir += DR[c->id];
             c->ic += DC[c->id];
         }
-        break;
+        NEXT;
 
         /* Fork */
-    case 'Y':
-        ptr = fork_cursor(i, ptr);
-        break;
+    CASE(OP_FORK)
+        fork_cursor(i, c);
+        count = 2;
+        NEXT;
+
+#ifndef THREADED_DISPATCH
+    default:
+        assert(0);
+#endif
     }
 
+data:
+    if (effect != 0)
+        push_effect(r, c->dr, c->dc, effect);
+move:
     /* Move instruction pointer */
     move_ip(i, c);
-
-    return &c->next;
+    return count;
 }
 
-int interpreter_step(struct Interpreter *i, int in, int *out)
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+
+/* Runs a copy of the cursor at `c' in the next free entry of r->out, and
+   keeps the resulting cursors. */
+static INLINE void run_copy(struct Interpreter *i, struct Run *r,
+                            const struct Cursor *c)
 {
-    struct Cursor **ptr, *c;
-    int result;
+    struct Cursor *d = &r->out[r->num_out];
+    int count;
 
-    if (!i->cursors)
-        return I_EXIT;
+    *d = *c;
+    count = run_cursor(i, r, d);
+    keep(i, r, d);
+    if (count == 2)
+    {
+        r->forks += 1;
+        keep(i, r, d + 1);
+    }
+}
 
-    result = I_SUCCESS;
-    i->output = IO_NONE;
+#ifdef USE_AVX2
+/* AVX2 version of run_cursor() for eight cursors at a time, used when the
+   processor supports it. The positions of eight cursors are loaded with
+   four 256-bit loads and transposed so that each vector holds one member of
+   all eight cursors. Groups with a cursor that forks, outputs, or moves its
+   data pointer off the top or bottom of the field are left to run_cursor(). */
+#define AVX2 __attribute__((target("avx2")))
 
-    /* Run cursors */
-    ptr = &i->cursors;
-    while (ptr && *ptr)
-        ptr = run_cursor(i, ptr);
+typedef char cursor_layout_check[offsetof(struct Cursor, id) == 16 &&
+                                 sizeof(struct Cursor) == 20 ? 1 : -1];
 
-    /* Apply input read */
-    if ((in & ~255) == 0)
-    {
-        for (c = i->cursors; c; c = c->next)
-            if ((c->effect&E_MASK) == E_INPUT)
-                set(i, c->dr, c->dc, in);
-    }
+/* Transposes the 4x4 matrices of 32-bit values in each half of v[0..3]. */
+static INLINE AVX2 void transpose4(__m256i v[4])
+{
+    __m256i t0, t1, t2, t3;
+
+    t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+    t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+    t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+    t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+    v[0] = _mm256_unpacklo_epi64(t0, t2);
+    v[1] = _mm256_unpackhi_epi64(t0, t2);
+    v[2] = _mm256_unpacklo_epi64(t1, t3);
+    v[3] = _mm256_unpackhi_epi64(t1, t3);
+}
 
-    /* Apply additions/subtractions */
-    for (c = i->cursors; c; c = c->next)
-        if ((c->effect&E_MASK) == E_ADD)
-            add(i, c->dr, c->dc, c->effect);
+/* Fetches the bytes at (row, col) from the cells, or with `plane' set, from
+   the opcode plane. */
+static INLINE AVX2 __m256i fetch(struct Interpreter *i, __m256i row,
+                                 __m256i col, int plane)
+{
+    const __m256i width = _mm256_set1_epi32(i->fld_cap.width);
+    const unsigned char *p[8];
+    int chunk[8], n[8], k;
+    __m256i offset;
 
-    /* Clear cells */
-    if (i->flags & F_CLEAR_MODE)
+    if (i->flags & F_TILED)
+    {
+        offset = _mm256_add_epi32(_mm256_mullo_epi32(
+                _mm256_and_si256(_mm256_srli_epi32(row, TILE_SHIFT),
+                    _mm256_set1_epi32(CHUNK_ROWS/TILE - 1)),
+                _mm256_slli_epi32(width, TILE_SHIFT)),
+            _mm256_slli_epi32(_mm256_srli_epi32(col, TILE_SHIFT),
+                              2*TILE_SHIFT));
+        offset = _mm256_add_epi32(offset, _mm256_add_epi32(
+            _mm256_slli_epi32(_mm256_and_si256(row,
+                _mm256_set1_epi32(TILE - 1)), TILE_SHIFT),
+            _mm256_and_si256(col, _mm256_set1_epi32(TILE - 1))));
+    }
+    else
     {
-        for (c = i->cursors; c; c = c->next)
-            if ((c->effect&E_MASK) == E_CLEAR)
-                set(i, c->dr, c->dc, 0);
+        offset = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(row,
+                _mm256_set1_epi32(CHUNK_ROWS - 1)), width), col);
     }
+    _mm256_storeu_si256((__m256i *)chunk, _mm256_srli_epi32(row, CHUNK_SHIFT));
+    _mm256_storeu_si256((__m256i *)n, _mm256_add_epi32(offset,
+        _mm256_set1_epi32(plane ? PLANE(i) : 0)));
+    for (k = 0; k < 8; ++k)
+        p[k] = (const unsigned char *)i->chunks[chunk[k]] + n[k];
+    return _mm256_setr_epi32(*p[0], *p[1], *p[2], *p[3],
+                             *p[4], *p[5], *p[6], *p[7]);
+}
+
+#define SET1(x)     _mm256_set1_epi32(x)
+#define EQ(a, b)    _mm256_cmpeq_epi32(a, b)
+#define GT(a, b)    _mm256_cmpgt_epi32(a, b)
+#define AND(a, b)   _mm256_and_si256(a, b)
+#define OR(a, b)    _mm256_or_si256(a, b)
+#define ADD(a, b)   _mm256_add_epi32(a, b)
+#define SUB(a, b)   _mm256_sub_epi32(a, b)
+#define SEL(m, a, b) _mm256_blendv_epi8(b, a, m)    /* m ? a : b */
+
+/* Runs cursors from `begin' in groups of eight, like run_copy(). Returns
+   the first cursor that was not run. */
+static AVX2 int run_avx2(struct Interpreter *i, struct Run *r,
+                         int begin, int end)
+{
+    const __m256i dr_tab = _mm256_setr_epi32(0, 1, 0, -1, 0, 0, 0, 0);
+    const __m256i dc_tab = _mm256_setr_epi32(1, 0, -1, 0, 0, 0, 0, 0);
+    const __m256i zero = _mm256_setzero_si256(), one = SET1(1);
+    const __m256i byte = SET1(0xff);
+    const __m256i meta = _mm256_setr_epi32(0, 5, 10, 15, 20, 25, 30, 35);
+    const __m256i width = SET1(i->fld_sz.width);
+    const __m256i height = SET1(i->fld_sz.height);
+    const __m256i no_clear = SET1(i->flags & F_CLEAR_MODE ? 0 : -1);
+    __m256i v[4], info, id, dm, op, value, move, mode, slow;
+    __m256i effect, delta, twice;
+    struct Cursor *c, *d;
+    int n, k, effects[8], rows[8], cols[8], infos[8];
 
-    /* Remove cursors with invalid IP */
-    ptr = &i->cursors;
-    while (ptr && *ptr)
+    for (n = begin; n + 8 <= end; n += 8)
     {
-        c = *ptr;
-        if (c->ir < 0 || c->ir >= i->fld_sz.height)
+        /* Load positions (ir, ic, dr, dc) and the id/dm/weight word */
+        c = &i->cursors[n];
+        d = &r->out[r->num_out];
+        for (k = 0; k < 4; ++k)
+            v[k] = _mm256_loadu2_m128i((const __m128i *)&c[k + 4].ir,
+                                       (const __m128i *)&c[k].ir);
+        transpose4(v);
+        info = _mm256_i32gather_epi32((const int *)&c->id, meta, 4);
+        id = AND(info, byte);
+        dm = AND(_mm256_srli_epi32(info, 8), byte);
+        op = fetch(i, v[0], v[1], 1);
+        value = _mm256_srai_epi32(_mm256_slli_epi32(
+                    fetch(i, v[2], v[3], 0), 24), 24);
+
+        /* Data pointer moves */
+        move = AND(GT(op, SET1(OP_NOP)), GT(SET1(OP_NONE), op));
+        slow = OR(EQ(op, SET1(OP_FORK)), AND(move, OR(EQ(dm, SET1(M_OUTPUT)),
+                  OR(AND(EQ(op, SET1(OP_UP)), EQ(v[2], zero)),
+                     AND(EQ(op, SET1(OP_DOWN)),
+                         EQ(ADD(v[2], one), height))))));
+        delta = _mm256_mullo_epi32(value,
+                                   AND(_mm256_srli_epi32(info, 16), byte));
+        effect = OR(OR(AND(EQ(dm, SET1(M_ADD)), AND(delta, byte)),
+                       AND(EQ(dm, SET1(M_SUBTRACT)),
+                           AND(SUB(zero, delta), byte))),
+                    OR(AND(EQ(dm, SET1(M_INPUT)), SET1(E_INPUT)),
+                       AND(EQ(dm, SET1(M_CLEAR)), SET1(E_CLEAR))));
+        effect = AND(effect, move);
+        if (!_mm256_testz_si256(slow, slow))
         {
-            ptr = kill_cursor(ptr);
+            for (k = 0; k < 8; ++k)
+                run_copy(i, r, &c[k]);
             continue;
         }
-        if (cursor_needs_input(i, c))
-            result |= I_INPUT;
-        ptr = &(*ptr)->next;
-    }
+        delta = SUB(op, one);
+        v[2] = ADD(v[2], AND(_mm256_permutevar8x32_epi32(dr_tab, delta), move));
+        v[3] = ADD(v[3], AND(_mm256_permutevar8x32_epi32(dc_tab, delta), move));
+        v[3] = SEL(EQ(v[3], width), zero, v[3]);
+        v[3] = SEL(EQ(v[3], SET1(-1)), SUB(width, one), v[3]);
 
-    /* Write output */
-    if (i->output < 256)
-    {
-        *out = i->output;
-        result |= I_OUTPUT;
-    }
+        /* Data mode changes */
+        mode = AND(GT(op, SET1(OP_NONE - 1)), GT(SET1(OP_CLEAR + 1), op));
+        mode = _mm256_andnot_si256(AND(EQ(op, SET1(OP_CLEAR)), no_clear), mode);
+        dm = SEL(mode, SUB(op, SET1(OP_NONE)), dm);
 
-    return result;
-}
+        /* Direction changes */
+        id = _mm256_xor_si256(id, OR(OR(AND(EQ(op, SET1(OP_BACKSLASH)), one),
+                                        AND(EQ(op, SET1(OP_SLASH)), SET1(3))),
+                                     AND(EQ(op, SET1(OP_BAR)), SET1(2))));
 
-struct Size interpreter_size(struct Interpreter *i)
-{
-    return i->fld_sz;
-}
+        /* Move the instruction pointer, twice for jumps and taken branches */
+        twice = OR(EQ(op, SET1(OP_JUMP)),
+                   AND(EQ(op, SET1(OP_BRANCH)), EQ(value, zero)));
+        delta = _mm256_permutevar8x32_epi32(dr_tab, id);
+        v[0] = ADD(v[0], ADD(delta, AND(delta, twice)));
+        delta = _mm256_permutevar8x32_epi32(dc_tab, id);
+        v[1] = ADD(v[1], ADD(delta, AND(delta, twice)));
+        for (k = 0; k < 2; ++k)
+        {
+            v[1] = ADD(v[1], AND(GT(zero, v[1]), width));
+            v[1] = SUB(v[1], AND(GT(v[1], SUB(width, one)), width));
+        }
 
-int interpreter_needs_input(struct Interpreter *i)
-{
-    struct Cursor *c;
+        /* Record data effects */
+        if (!_mm256_testz_si256(effect, effect))
+        {
+            _mm256_storeu_si256((__m256i *)effects, effect);
+            _mm256_storeu_si256((__m256i *)rows, v[2]);
+            _mm256_storeu_si256((__m256i *)cols, v[3]);
+            for (k = 0; k < 8; ++k)
+                if (effects[k] != 0)
+                    push_effect(r, rows[k], cols[k], effects[k]);
+        }
 
-    for  (c = i->cursors; c; c = c->next)
-        if (cursor_needs_input(i, c))
-            return 1;
-    return 0;
+        /* Store the cursors in the output, then keep or merge them */
+        transpose4(v);
+        for (k = 0; k < 4; ++k)
+        {
+            _mm_storeu_si128((__m128i *)&d[k].ir, _mm256_castsi256_si128(v[k]));
+            _mm_storeu_si128((__m128i *)&d[k + 4].ir,
+                             _mm256_extracti128_si256(v[k], 1));
+        }
+        info = OR(_mm256_andnot_si256(SET1(0xffff), info),
+                  OR(id, _mm256_slli_epi32(dm, 8)));
+        _mm256_storeu_si256((__m256i *)infos, info);
+        for (k = 0; k < 8; ++k)
+        {
+            memcpy(&d[k].id, &infos[k], sizeof(int));
+            keep(i, r, &d[k]);
+        }
+    }
+    return n;
 }
 
-struct Interpreter *interpreter_create()
+#undef SET1
+#undef EQ
+#undef GT
+#undef AND
+#undef OR
+#undef ADD
+#undef SUB
+#undef SEL
+#endif /* def USE_AVX2 */
+
+/* Runs cursors [begin, end) into r->out, which has room for two cursors
+   per cursor run, and r->effects, which has room for one effect each. */
+static void run_range(struct Interpreter *i, struct Run *r, int begin, int end)
 {
-    struct Interpreter *i;
+    int n;
 
-    i = malloc(sizeof(struct Interpreter));
+    r->num_out = 0;
+    r->num_effects = 0;
+    r->inputs = r->clears = 0;
+    r->output = IO_NONE;
+    r->height = i->fld_sz.height;
+    r->waiting = 0;
+    r->late = 0;
+    r->forks = r->merges = 0;
+    memset(r->kills, 0, sizeof(r->kills));
+    n = begin;
+#ifdef USE_AVX2
+    if (end - begin >= 16 && !(i->flags & F_NO_SIMD) &&
+        __builtin_cpu_supports("avx2"))
+        n = run_avx2(i, r, begin, end);
+#endif
+    for (; n < end; ++n)
+        run_copy(i, r, &i->cursors[n]);
+}
+
+#ifdef USE_THREADS
+/* A pool of worker threads that is kept for the lifetime of the
+   interpreter. For each step the cursor array is split into contiguous
+   ranges; the calling thread runs the first range itself, and the results
+   are combined in cursor order so they do not depend on the thread count.
+   Workers do not merge cursors, since the hash table is shared. */
+struct Worker {
+    struct Pool *pool;
+    pthread_t thread;
+    struct Run run;
+    int begin, end;
+};
+
+struct Pool {
+    struct Interpreter *interp;
+    struct Worker *workers;     /* workers[0] is the calling thread */
+    int num_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned generation;        /* incremented for each batch of work */
+    int pending;                /* threads still running the current batch */
+    int quit;
+};
+
+static void *worker_main(void *arg)
+{
+    struct Worker *w = arg;
+    struct Pool *p = w->pool;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (p->generation == generation && !p->quit)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->quit)
+            break;
+        generation = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        run_range(p->interp, &w->run, w->begin, w->end);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void destroy_pool(struct Pool *p)
+{
+    int n;
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (n = 1; n < p->num_workers; ++n)
+        pthread_join(p->workers[n].thread, NULL);
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->start);
+    pthread_mutex_destroy(&p->lock);
+    free(p->workers);
+    free(p);
+}
+
+/* Creates a pool with up to `threads' threads (including the caller). */
+static struct Pool *create_pool(struct Interpreter *i, int threads)
+{
+    struct Pool *p;
+
+    p = malloc(sizeof(struct Pool));
+    if (!p)
+        return NULL;
+    memset(p, 0, sizeof(struct Pool));
+    p->interp = i;
+    p->workers = calloc(threads, sizeof(struct Worker));
+    if (!p->workers)
+    {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->workers[0].pool = p;
+    for (p->num_workers = 1; p->num_workers < threads; ++p->num_workers)
+    {
+        struct Worker *w = &p->workers[p->num_workers];
+
+        w->pool = p;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+            break;
+    }
+    return p;
+}
+
+/* Runs all cursors on the threads of the pool. */
+static void run_parallel(struct Interpreter *i, struct Run *run)
+{
+    struct Pool *p = i->pool;
+    struct Run *r;
+    int n, k, count, num = i->num_cursors;
+
+    /* Split the cursors evenly over as many threads as is worthwhile */
+    count = num/MIN_CURSORS_PER_THREAD;
+    if (count > p->num_workers)
+        count = p->num_workers;
+    if (count < 1)
+        count = 1;
+    for (n = 0; n < p->num_workers; ++n)
+    {
+        struct Worker *w = &p->workers[n];
+
+        w->begin = n < count ? (int)((long long)num*n/count) : num;
+        w->end = n < count ? (int)((long long)num*(n + 1)/count) : num;
+        w->run.out = i->spare + 2*w->begin;
+        w->run.effects = i->effects + w->begin;
+        w->run.mask = 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->pending = p->num_workers - 1;
+    p->generation += 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    run_range(i, &p->workers[0].run, p->workers[0].begin, p->workers[0].end);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    /* Combine results in cursor order, merging cursors on the way. The
+       output of each range starts at or after the combined output so far. */
+    run->num_out = 0;
+    run->num_effects = 0;
+    run->inputs = run->clears = 0;
+    run->output = IO_NONE;
+    run->height = i->fld_sz.height;
+    run->waiting = 0;
+    run->late = 0;
+    run->forks = run->merges = 0;
+    memset(run->kills, 0, sizeof(run->kills));
+    for (n = 0; n < count; ++n)
+    {
+        r = &p->workers[n].run;
+        if (r->height > run->height)
+            run->height = r->height;
+        run->forks += r->forks;
+        for (k = 0; k < NUM_KILLS; ++k)
+            run->kills[k] += r->kills[k];
+    }
+    for (n = 0; n < count; ++n)
+    {
+        r = &p->workers[n].run;
+        for (k = 0; k < r->num_out; ++k)
+            keep(i, run, &r->out[k]);
+        memmove(run->effects + run->num_effects, r->effects,
+                r->num_effects*sizeof(struct Effect));
+        run->num_effects += r->num_effects;
+        run->inputs += r->inputs;
+        run->clears += r->clears;
+        if (run->output == IO_NONE)
+            run->output = r->output;
+        else
+        if (r->output != IO_NONE && r->output != run->output)
+            run->output = IO_BLOCK;
+    }
+}
+#endif /* def USE_THREADS */
+
+/* Executes a step for any number of cursors: all cursors are run against
+   the current field first, then their data effects are applied. Running a
+   cursor also removes or merges it and records its data effect, so the
+   cursor array is traversed only once per step. */
+static int step_cursors(struct Interpreter *i, int in, int *out)
+{
+    struct Cursor *c, *end, *next;
+    struct Effect *e, *last;
+    struct Run run;
+    int n, result, mask;
+
+    /* Every cursor may fork, so make sure there is room for twice as many
+       cursors as there are now. */
+    if (2*i->num_cursors > i->cap_cursors &&
+        !reserve_cursors(i, 2*i->num_cursors))
+        return I_ERROR;
+
+    /* Clear the hash table used to merge cursors */
+    for (mask = 1; mask < 4*i->num_cursors; mask *= 2) { }
+    mask -= 1;
+    memset(i->slots, 0, (mask + 1)*sizeof(int));
+
+    /* Run cursors */
+    run.out = i->spare;
+    run.effects = i->effects;
+    run.mask = mask;
+#ifdef USE_THREADS
+    if (i->pool && i->num_cursors >= 2*MIN_CURSORS_PER_THREAD)
+        run_parallel(i, &run);
+    else
+#endif
+    run_range(i, &run, 0, i->num_cursors);
+    if (run.height > i->fld_sz.height)
+        ensure(i, run.height, 0);
+    c = i->cursors;
+    i->cursors = i->spare;
+    i->spare = c;
+    i->num_cursors = run.num_out;
+    i->stats.forks += run.forks;
+    i->stats.merges += run.merges;
+    for (n = 0; n < NUM_KILLS; ++n)
+        i->stats.kills[n] += run.kills[n];
+
+    /* Apply input read, then additions/subtractions, then clear cells */
+    last = run.effects + run.num_effects;
+    if (run.inputs > 0 && (in & ~255) == 0)
+    {
+        i->stats.input += 1;
+        for (e = run.effects; e != last; ++e)
+            if (e->effect == E_INPUT)
+                set(i, e->row, e->col, in);
+    }
+    for (e = run.effects; e != last; ++e)
+        if ((e->effect&E_MASK) == E_ADD)
+            add(i, e->row, e->col, e->effect);
+    if (run.clears > 0 && (i->flags & F_CLEAR_MODE))
+    {
+        for (e = run.effects; e != last; ++e)
+            if (e->effect == E_CLEAR)
+                set(i, e->row, e->col, 0);
+    }
+
+    result = I_SUCCESS;
+    if (run.late)
+    {
+        /* Remove cursors below the field, which rarely happens */
+        next = i->cursors;
+        end = i->cursors + i->num_cursors;
+        for (c = i->cursors; c != end; ++c)
+        {
+            if (c->ir >= i->fld_sz.height)
+            {
+                i->stats.kills[K_IP_BOTTOM] += 1;
+                continue;
+            }
+            if (next != c)
+                *next = *c;
+            ++next;
+        }
+        i->num_cursors = next - i->cursors;
+        i->readers = count_readers(i);
+    }
+    else
+    {
+        /* Only cursors in input mode can read, and the cells have been
+           written, so their instructions are final */
+        i->readers = 0;
+        for (n = 0; n < run.waiting; ++n)
+            i->readers += cursor_needs_input(i, &i->cursors[i->waiting[n]]);
+    }
+    if (i->readers > 0)
+        result |= I_INPUT;
+    if (i->num_cursors > i->stats.peak_cursors)
+        i->stats.peak_cursors = i->num_cursors;
+
+    /* Write output, unless cursors wrote different characters */
+    if (run.output < 256)
+    {
+        *out = run.output;
+        result |= I_OUTPUT;
+    }
+    else
+    if (run.output == IO_BLOCK)
+        i->stats.blocked += 1;
+
+    return result;
+}
+
+/* Executes a step for a program with a single cursor. Since there are no
+   other cursors to combine effects with, a data operation is applied to
+   the field directly instead of being recorded for the apply passes of
+   step_cursors(), which remains the fallback for forks. */
+static int step_single(struct Interpreter *i, int in, int *out)
+{
+    struct Cursor *c = &i->cursors[0];
+    struct Run run;
+    int row, col, code, result;
+    char value;
+
+    result = I_SUCCESS;
+    code = op(i, c->ir, c->ic);
+    switch (code)
+    {
+    case OP_RIGHT:
+    case OP_DOWN:
+    case OP_LEFT:
+    case OP_UP:
+    case OP_HERE:
+        if (code == OP_UP && c->dr == 0)
+        {
+            i->stats.kills[K_DATA_TOP] += 1;
+            i->num_cursors = 0;
+            i->readers = 0;
+            return result;
+        }
+
+        /* Move the data pointer, remembering the source cell */
+        value = get(i, c->dr, c->dc);
+        row = c->dr;
+        col = c->dc;
+        if (code != OP_HERE)
+        {
+            row += DR[code - OP_RIGHT];
+            col += DC[code - OP_RIGHT];
+            if (col < 0)
+                col = i->fld_sz.width - 1;
+            else
+            if (col == i->fld_sz.width)
+                col = 0;
+            if (row == i->fld_sz.height)
+                ensure(i, row + 1, 0);
+        }
+        c->dr = row;
+        c->dc = col;
+
+        /* Perform the data operation */
+        switch (c->dm)
+        {
+        case M_ADD:
+            add(i, row, col, c->weight*value);
+            break;
+        case M_SUBTRACT:
+            add(i, row, col, -c->weight*value);
+            break;
+        case M_INPUT:
+            if ((in & ~255) == 0)
+            {
+                i->stats.input += 1;
+                set(i, row, col, in);
+            }
+            break;
+        case M_OUTPUT:
+            *out = value;
+            result |= I_OUTPUT;
+            break;
+        case M_CLEAR:
+            if (i->flags & F_CLEAR_MODE)
+                set(i, row, col, 0);
+            break;
+        }
+        move_ip(i, c);
+        break;
+
+    case OP_FORK:
+        return step_cursors(i, in, out);
+
+    default:
+        /* Cannot fork or touch the field */
+        run_cursor(i, &run, c);
+        break;
+    }
+
+    if (c->ir < 0 || c->ir >= i->fld_sz.height)
+    {
+        i->stats.kills[c->ir < 0 ? K_IP_TOP : K_IP_BOTTOM] += 1;
+        i->num_cursors = 0;
+        i->readers = 0;
+    }
+    else
+    {
+        i->readers = cursor_needs_input(i, c);
+        if (i->readers > 0)
+            result |= I_INPUT;
+    }
+    return result;
+}
+
+/* Closed-form loops. Programs translated by bf2ref spend most of their time
+   in loops that count a cell down to zero while adding constants to other
+   cells, taking hundreds of steps per iteration. When a single cursor is
+   about to execute a branch that is not taken, skip_loop() traces one
+   iteration on a private overlay of the cells it writes, until the cursor
+   returns to the branch. If the iteration does no I/O, does not fork or
+   grow the field, writes no cell that it executes, and returns with the
+   same data pointer, every iteration behaves identically as long as:
+
+    - no cell with a net change is read as the source of an addition, and
+    - no branch on a cell with a net change changes outcome.
+
+   In that case the net changes are applied for all remaining iterations at
+   once (or as many as fit in the step budget), leaving the cursor at the
+   branch, exactly as if the steps had been executed one by one.
+
+   Branches where the trace fails are not traced again for a while, with
+   exponential backoff, so loops that do not qualify cost little. */
+struct Trace {
+    struct Cursor c;
+    int steps, num_writes, num_reads;
+    struct { int row, col; } code[LOOP_MAX_STEPS];
+    struct { int row, col; char start, value; } writes[LOOP_MAX_WRITES];
+    struct { int row, col; char value, branch; } reads[LOOP_MAX_READS];
+};
+
+struct LoopHint {
+    int ir, ic, id, dm;
+    int skip, backoff;
+};
+
+/* Returns the overlay value of cell (row, col), recording the read. */
+static int trace_read(struct Interpreter *i, struct Trace *t, int row, int col,
+                      int branch)
+{
+    int n;
+    char value = get(i, row, col);
+
+    for (n = 0; n < t->num_writes; ++n)
+        if (t->writes[n].row == row && t->writes[n].col == col)
+            value = t->writes[n].value;
+    if (t->num_reads == LOOP_MAX_READS)
+        return -1;
+    t->reads[t->num_reads].row = row;
+    t->reads[t->num_reads].col = col;
+    t->reads[t->num_reads].value = value;
+    t->reads[t->num_reads].branch = branch;
+    t->num_reads += 1;
+    return (unsigned char)value;
+}
+
+/* Adds `value' to cell (row, col) in the overlay. */
+static int trace_add(struct Interpreter *i, struct Trace *t, int row, int col,
+                     int value)
+{
+    int n;
+
+    for (n = 0; n < t->num_writes; ++n)
+        if (t->writes[n].row == row && t->writes[n].col == col)
+            break;
+    if (n == t->num_writes)
+    {
+        if (n == LOOP_MAX_WRITES)
+            return 0;
+        t->writes[n].row = row;
+        t->writes[n].col = col;
+        t->writes[n].start = t->writes[n].value = get(i, row, col);
+        t->num_writes += 1;
+    }
+    t->writes[n].value += value;
+    return 1;
+}
+
+/* Returns the net change of cell (row, col) in one iteration. */
+static int trace_delta(struct Trace *t, int row, int col)
+{
+    int n;
+
+    for (n = 0; n < t->num_writes; ++n)
+        if (t->writes[n].row == row && t->writes[n].col == col)
+            return (t->writes[n].value - t->writes[n].start)&0xff;
+    return 0;
+}
+
+/* Traces one iteration of the loop starting at the cursor's branch. Returns
+   0 if the loop does not qualify. */
+static int trace_loop(struct Interpreter *i, struct Trace *t)
+{
+    struct Cursor *c = &t->c, *head = &i->cursors[0];
+    int code, row, col, value, n, k;
+
+    *c = *head;
+    t->steps = t->num_writes = t->num_reads = 0;
+    do {
+        if (t->steps == LOOP_MAX_STEPS)
+            return 0;
+        t->code[t->steps].row = c->ir;
+        t->code[t->steps].col = c->ic;
+        t->steps += 1;
+        switch (code = op(i, c->ir, c->ic))
+        {
+        case OP_RIGHT:
+        case OP_DOWN:
+        case OP_LEFT:
+        case OP_UP:
+        case OP_HERE:
+            if (c->dm != M_NONE && c->dm != M_ADD && c->dm != M_SUBTRACT)
+                return 0;
+            if (code == OP_UP && c->dr == 0)
+                return 0;
+            row = c->dr;
+            col = c->dc;
+            if (code != OP_HERE)
+            {
+                row += DR[code - OP_RIGHT];
+                col += DC[code - OP_RIGHT];
+                if (col < 0)
+                    col = i->fld_sz.width - 1;
+                else
+                if (col == i->fld_sz.width)
+                    col = 0;
+                if (row == i->fld_sz.height)
+                    return 0;
+            }
+            if (c->dm != M_NONE)
+            {
+                value = trace_read(i, t, c->dr, c->dc, 0);
+                if (value < 0)
+                    return 0;
+                value *= c->weight;
+                if (!trace_add(i, t, row, col,
+                               c->dm == M_ADD ? value : -value))
+                    return 0;
+            }
+            c->dr = row;
+            c->dc = col;
+            break;
+        case OP_NONE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_INPUT:
+        case OP_OUTPUT:
+            c->dm = code - OP_NONE;
+            break;
+        case OP_CLEAR:
+            if (i->flags & F_CLEAR_MODE)
+                c->dm = M_CLEAR;
+            break;
+        case OP_BACKSLASH: c->id ^= 1; break;
+        case OP_SLASH:     c->id ^= 3; break;
+        case OP_BAR:       c->id ^= 2; break;
+        case OP_JUMP:
+            move_ip(i, c);
+            break;
+        case OP_BRANCH:
+            value = trace_read(i, t, c->dr, c->dc, 1);
+            if (value < 0)
+                return 0;
+            if (value == 0)
+            {
+                c->ir += DR[c->id];
+                c->ic += DC[c->id];
+            }
+            break;
+        case OP_FORK:
+            return 0;
+        }
+        move_ip(i, c);
+        if (c->ir < 0 || c->ir >= i->fld_sz.height)
+            return 0;
+    } while (c->ir != head->ir || c->ic != head->ic || c->id != head->id ||
+             c->dm != head->dm);
+
+    if (c->dr != head->dr || c->dc != head->dc)
+        return 0;
+
+    /* The code must not be modified */
+    for (n = 0; n < t->num_writes; ++n)
+        for (k = 0; k < t->steps; ++k)
+            if (t->writes[n].row == t->code[k].row &&
+                t->writes[n].col == t->code[k].col)
+                return 0;
+    return 1;
+}
+
+/* Executes as many iterations of the loop at the single cursor's branch as
+   possible in closed form, within `max_steps' steps. Returns the number of
+   steps skipped, or 0 if the loop was not skipped. */
+static int skip_loop(struct Interpreter *i, int max_steps)
+{
+    struct Cursor *c = &i->cursors[0];
+    struct LoopHint *h;
+    struct Trace t;
+    int n, j, delta, value, iterations;
+
+    if (op(i, c->ir, c->ic) != OP_BRANCH || get(i, c->dr, c->dc) == 0)
+        return 0;
+
+    if (!i->loops)
+    {
+        i->loops = calloc(LOOP_HINTS, sizeof(struct LoopHint));
+        if (!i->loops)
+            return 0;
+    }
+    h = &i->loops[(unsigned)(c->ir*31 + c->ic) % LOOP_HINTS];
+    if (h->ir == c->ir && h->ic == c->ic && h->id == c->id &&
+        h->dm == c->dm && h->skip > 0)
+    {
+        h->skip -= 1;
+        return 0;
+    }
+
+    if (!trace_loop(i, &t))
+        goto failed;
+
+    /* The branch at the start counts its cell to zero after `iterations' */
+    delta = trace_delta(&t, c->dr, c->dc);
+    value = (unsigned char)get(i, c->dr, c->dc);
+    for (iterations = 1; iterations < 256; ++iterations)
+        if (((value + iterations*delta)&0xff) == 0)
+            break;
+    if (iterations == 256)
+        goto failed;
+    if (iterations > max_steps/t.steps)
+        iterations = max_steps/t.steps;
+    if (iterations < 2)
+        return 0;
+
+    /* Every iteration must read the same values and take the same branches */
+    for (n = 0; n < t.num_reads; ++n)
+    {
+        delta = trace_delta(&t, t.reads[n].row, t.reads[n].col);
+        if (delta == 0)
+            continue;
+        if (!t.reads[n].branch)
+            goto failed;
+        value = (unsigned char)t.reads[n].value;
+        for (j = 1; j < iterations; ++j)
+            if ((((value + j*delta)&0xff) == 0) != (value == 0))
+                goto failed;
+    }
+
+    for (n = 0; n < t.num_writes; ++n)
+    {
+        delta = (t.writes[n].value - t.writes[n].start)&0xff;
+        if (delta != 0)
+            set(i, t.writes[n].row, t.writes[n].col,
+                t.writes[n].start + iterations*delta);
+    }
+    h->backoff = 0;
+    i->readers = 0;             /* the cursor is back at its branch */
+    i->steps += (long long)iterations*t.steps;
+    return iterations*t.steps;
+
+failed:
+    h->ir = c->ir;
+    h->ic = c->ic;
+    h->id = c->id;
+    h->dm = c->dm;
+    h->backoff = h->backoff ? 2*h->backoff : 1;
+    if (h->backoff > 1024)
+        h->backoff = 1024;
+    h->skip = h->backoff;
+    return 0;
+}
+
+/* Compiled traces. Long-running programs, such as the Brainfuck interpreter
+   written in Refunge, spend most of their steps with a single cursor that
+   follows the same paths through the field again and again. When a single
+   cursor keeps arriving at the same branch, in the same direction and data
+   mode, record_trace() follows its path from there without executing it,
+   for as long as the path can be predicted: until it returns to the
+   branch, or up to a fork, a step that reads input or writes output, a
+   data pointer that would leave the field, wrap around or grow it, or an
+   instruction pointer that would leave the field. Of the steps on the
+   path, the trace keeps only the operations on cells, which are relative
+   to the data pointer at the start:
+
+    - additions, subtractions and clears of a cell;
+    - branches, as guards with a side exit to the other outcome.
+
+   Every exit holds the state of the cursor at that point and the number
+   of steps taken so far. A trace that ends at its branch runs as a loop,
+   which stays in the trace as long as it leaves the data pointer where it
+   was. When a trace exits, the trace starting where it left off runs
+   next, so that hot exits become traces of their own. On x86-64 Linux,
+   traces are compiled to machine code; elsewhere run_ops() interprets
+   them. Writes do not change the instruction classes of the cells while
+   a trace runs; they are brought up to date when it returns.
+
+   A trace runs in place of the steps it covers while it still applies:
+   every cell on its path still has the instruction class it was recorded
+   with (checked again after any cell changed class), the field has the
+   same width and clear mode, every cell the data pointer visits lies
+   within the field, and no cell the trace writes is on its path. Anything
+   else is left to the steps, as are branches that could not be recorded,
+   which are retried later with exponential backoff. */
+enum TraceKind {
+    T_ADD, T_SUBTRACT, T_CLEAR,     /* write cell dst (from cell src) */
+    T_ZERO, T_NONZERO               /* guard on the value of cell src */
+};
+
+struct TraceOp {
+    unsigned char kind, src, dst;   /* cells as indices into slots */
+};
+
+/* A side exit, with the data pointer relative to the start of the trace */
+struct TraceExit {
+    int steps;                  /* steps taken from the start */
+    struct Cursor c;            /* the cursor after them */
+};
+
+#ifdef USE_JIT
+typedef int (*TraceCode)(char **cells, long *iterations);
+#endif
+
+struct CompiledTrace {
+    int width, clear;           /* field width and clear mode */
+    int weight;                 /* weight of the cursor */
+    int steps;                  /* steps from the start to the end */
+    int loop;                   /* the end is the start (see exits[0]) */
+    int num_ops, num_slots, num_code;
+    struct TraceOp *ops;
+    struct TraceExit *exits;    /* the end, then the exit of each guard */
+    struct { int row, col, written; } *slots;   /* cells, relative */
+    struct { int row, col, code; } *code;       /* cells on the path */
+    int *code_set, code_mask;   /* hash set of indices into code, plus 1 */
+    int min_dr, max_dr, min_dc, max_dc;         /* data pointer range */
+    int max_ir;
+    long long op_changes;       /* i->op_changes when the code was checked */
+    char **cells;               /* the slots, while the trace runs */
+#ifdef USE_JIT
+    TraceCode native;           /* machine code, or NULL */
+    size_t native_size;
+#endif
+};
+
+struct TraceEntry {
+    int ir, ic, id, dm, weight;
+    int hits, skip, backoff;
+    struct CompiledTrace *t;
+};
+
+/* The table of hot states, indexed by a hash of the position and
+   direction, and the set of cells on the paths of the traces in it, so
+   that set_op() can tell when a trace may have to be dropped. The set only
+   grows; when it is half full, it starts over with the traces dropped. */
+struct TraceCache {
+    struct TraceEntry entries[TRACE_ENTRIES];
+    struct { int row, col; } marks[TRACE_MARKS];    /* row + 1, or 0 */
+    int num_marks;
+};
+
+static INLINE unsigned cell_hash(int row, int col)
+{
+    return ((unsigned)row*0x9e3779b1u + (unsigned)col)*0x85ebca6bu >> 8;
+}
+
+static int on_trace_path(struct TraceCache *tc, int row, int col)
+{
+    unsigned h;
+
+    for (h = cell_hash(row, col); tc->marks[h % TRACE_MARKS].row; ++h)
+        if (tc->marks[h % TRACE_MARKS].row == row + 1 &&
+            tc->marks[h % TRACE_MARKS].col == col)
+            return 1;
+    return 0;
+}
+
+static void free_trace(struct CompiledTrace *t)
+{
+    if (!t)
+        return;
+#ifdef USE_JIT
+    if (t->native)
+        munmap((void *)t->native, t->native_size);
+#endif
+    free(t->ops);
+    free(t->exits);
+    free(t->slots);
+    free(t->code);
+    free(t->code_set);
+    free(t->cells);
+    free(t);
+}
+
+static void drop_traces(struct TraceCache *tc)
+{
+    int n;
+
+    for (n = 0; n < TRACE_ENTRIES; ++n)
+    {
+        free_trace(tc->entries[n].t);
+        tc->entries[n].t = NULL;
+        tc->entries[n].hits = 0;
+    }
+    memset(tc->marks, 0, sizeof(tc->marks));
+    tc->num_marks = 0;
+}
+
+static void free_traces(struct Interpreter *i)
+{
+    if (!i->traces)
+        return;
+    drop_traces(i->traces);
+    free(i->traces);
+    i->traces = NULL;
+}
+
+/* Adds the cells on the path of a trace to the marks, dropping all other
+   traces if the set is getting full. */
+static void mark_path(struct TraceCache *tc, struct CompiledTrace *t)
+{
+    unsigned h;
+    int n;
+
+    if (tc->num_marks + t->num_code > TRACE_MARKS/2)
+        drop_traces(tc);
+    for (n = 0; n < t->num_code; ++n)
+    {
+        if (on_trace_path(tc, t->code[n].row, t->code[n].col))
+            continue;
+        h = cell_hash(t->code[n].row, t->code[n].col);
+        while (tc->marks[h % TRACE_MARKS].row)
+            ++h;
+        tc->marks[h % TRACE_MARKS].row = t->code[n].row + 1;
+        tc->marks[h % TRACE_MARKS].col = t->code[n].col;
+        tc->num_marks += 1;
+    }
+}
+
+/* Returns the index into t->code of cell (row, col), or -1. With `add',
+   the cell is added if it is missing. */
+static int trace_code(struct CompiledTrace *t, int row, int col, int add)
+{
+    unsigned h;
+    int n;
+
+    for (h = cell_hash(row, col); ; ++h)
+    {
+        n = t->code_set[h & t->code_mask] - 1;
+        if (n < 0)
+            break;
+        if (t->code[n].row == row && t->code[n].col == col)
+            return n;
+    }
+    if (!add)
+        return -1;
+    n = t->num_code++;
+    t->code[n].row = row;
+    t->code[n].col = col;
+    t->code_set[h & t->code_mask] = n + 1;
+    return n;
+}
+
+/* Returns the slot of the cell at (row, col) relative to the start of the
+   trace, adding it with its value in the field, or -1 if there are too
+   many. */
+static int trace_slot(struct Interpreter *i, struct CompiledTrace *t,
+                      char *values, int row, int col)
+{
+    struct Cursor *head = &i->cursors[0];
+    int n;
+
+    for (n = 0; n < t->num_slots; ++n)
+        if (t->slots[n].row == row && t->slots[n].col == col)
+            return n;
+    if (n == TRACE_MAX_SLOTS)
+        return -1;
+    t->slots[n].row = row;
+    t->slots[n].col = col;
+    t->slots[n].written = 0;
+    values[n] = get(i, head->dr + row, head->dc + col);
+    t->num_slots += 1;
+    return n;
+}
+
+/* Records the path of the single cursor from its branch. Returns NULL if
+   it is too short or memory runs out. */
+static struct CompiledTrace *record_trace(struct Interpreter *i)
+{
+    struct Cursor *head = &i->cursors[0], c, next;
+    struct CompiledTrace *t;
+    struct TraceOp *o;
+    struct TraceExit *x;
+    char values[TRACE_MAX_SLOTS];
+    int code, kind, src = 0, dst = 0, row, col, n, size;
+
+    t = calloc(1, sizeof(struct CompiledTrace));
+    if (!t)
+        return NULL;
+    t->ops = malloc(TRACE_MAX_OPS*sizeof(*t->ops));
+    t->exits = malloc((TRACE_MAX_OPS + 1)*sizeof(*t->exits));
+    t->slots = malloc(TRACE_MAX_SLOTS*sizeof(*t->slots));
+    t->code = malloc(TRACE_MAX_STEPS*sizeof(*t->code));
+    if (!t->ops || !t->exits || !t->slots || !t->code)
+        goto failed;
+    t->width = i->fld_sz.width;
+    t->clear = i->flags & F_CLEAR_MODE;
+    t->weight = head->weight;
+
+    /* Follow the path, with the data pointer relative to the start */
+    c = *head;
+    c.dr = c.dc = 0;
+    for (;;)
+    {
+        if (t->steps > 0 && c.ir == head->ir && c.ic == head->ic &&
+            c.id == head->id && c.dm == head->dm)
+        {
+            t->loop = 1;
+            break;
+        }
+        if (t->steps == TRACE_MAX_STEPS)
+            break;
+        next = c;
+        kind = -1;
+        switch (code = op(i, c.ir, c.ic))
+        {
+        case OP_RIGHT:
+        case OP_DOWN:
+        case OP_LEFT:
+        case OP_UP:
+        case OP_HERE:
+            if (c.dm == M_INPUT || c.dm == M_OUTPUT)
+                goto end;
+            row = c.dr;
+            col = c.dc;
+            if (code != OP_HERE)
+            {
+                row += DR[code - OP_RIGHT];
+                col += DC[code - OP_RIGHT];
+            }
+            if (head->dr + row < 0 || head->dr + row >= i->fld_sz.height ||
+                head->dc + col < 0 || head->dc + col >= i->fld_sz.width)
+                goto end;
+            if (c.dm != M_NONE)
+            {
+                src = trace_slot(i, t, values, c.dr, c.dc);
+                dst = trace_slot(i, t, values, row, col);
+                if (src < 0 || dst < 0)
+                    goto end;
+                kind = c.dm == M_ADD ? T_ADD :
+                       c.dm == M_SUBTRACT ? T_SUBTRACT : T_CLEAR;
+            }
+            next.dr = row;
+            next.dc = col;
+            break;
+        case OP_NONE:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_INPUT:
+        case OP_OUTPUT:
+            next.dm = code - OP_NONE;
+            break;
+        case OP_CLEAR:
+            if (t->clear)
+                next.dm = M_CLEAR;
+            break;
+        case OP_BACKSLASH: next.id ^= 1; break;
+        case OP_SLASH:     next.id ^= 3; break;
+        case OP_BAR:       next.id ^= 2; break;
+        case OP_JUMP:
+            move_ip(i, &next);
+            break;
+        case OP_BRANCH:
+            src = dst = trace_slot(i, t, values, c.dr, c.dc);
+            if (src < 0)
+                goto end;
+            kind = values[src] == 0 ? T_ZERO : T_NONZERO;
+            if (kind == T_ZERO)
+            {
+                next.ir += DR[c.id];
+                next.ic += DC[c.id];
+            }
+            break;
+        case OP_FORK:
+            goto end;
+        }
+        move_ip(i, &next);
+        if (next.ir < 0 || next.ir >= i->fld_sz.height)
+            goto end;
+
+        if (kind >= 0)
+        {
+            if (t->num_ops == TRACE_MAX_OPS)
+                goto end;
+            o = &t->ops[t->num_ops];
+            o->kind = kind;
+            o->src = src;
+            o->dst = dst;
+            x = &t->exits[++t->num_ops];
+            x->steps = t->steps + 1;
+            switch (kind)
+            {
+            case T_ADD:
+                values[dst] += t->weight*values[src];
+                t->slots[dst].written = 1;
+                break;
+            case T_SUBTRACT:
+                values[dst] -= t->weight*values[src];
+                t->slots[dst].written = 1;
+                break;
+            case T_CLEAR:
+                values[dst] = 0;
+                t->slots[dst].written = 1;
+                break;
+            case T_ZERO:
+                x->c = c;
+                move_ip(i, &x->c);
+                break;
+            case T_NONZERO:
+                x->c = c;
+                x->c.ir += DR[c.id];
+                x->c.ic += DC[c.id];
+                move_ip(i, &x->c);
+                break;
+            }
+        }
+        t->code[t->steps].row = c.ir;
+        t->code[t->steps].col = c.ic;
+        t->code[t->steps].code = code;
+        t->steps += 1;
+        if (c.ir > t->max_ir)
+            t->max_ir = c.ir;
+        c = next;
+        if (c.dr < t->min_dr) t->min_dr = c.dr;
+        if (c.dr > t->max_dr) t->max_dr = c.dr;
+        if (c.dc < t->min_dc) t->min_dc = c.dc;
+        if (c.dc > t->max_dc) t->max_dc = c.dc;
+    }
+end:
+    t->exits[0].steps = t->steps;
+    t->exits[0].c = c;
+    if (t->steps < TRACE_MIN_STEPS)
+        goto failed;
+
+    /* Keep the cells on the path once each, with their classes */
+    for (size = 1; size < 2*t->steps; size *= 2)
+        ;
+    t->code_set = calloc(size, sizeof(int));
+    t->cells = malloc(t->num_slots*sizeof(char *));
+    if (!t->code_set || !t->cells)
+        goto failed;
+    t->code_mask = size - 1;
+    for (n = 0; n < t->steps; ++n)
+    {
+        row = t->code[n].row;
+        col = t->code[n].col;
+        code = t->code[n].code;
+        t->code[trace_code(t, row, col, 1)].code = code;
+    }
+
+    /* Slots that were added for a step that was not taken still count */
+    for (n = 0; n < t->num_slots; ++n)
+    {
+        if (t->slots[n].row < t->min_dr) t->min_dr = t->slots[n].row;
+        if (t->slots[n].row > t->max_dr) t->max_dr = t->slots[n].row;
+        if (t->slots[n].col < t->min_dc) t->min_dc = t->slots[n].col;
+        if (t->slots[n].col > t->max_dc) t->max_dc = t->slots[n].col;
+    }
+    return t;
+
+failed:
+    free_trace(t);
+    return NULL;
+}
+
+/* Whether the cells on the path of a trace still have their classes */
+static int check_code(struct Interpreter *i, struct CompiledTrace *t)
+{
+    int n;
+
+    if (t->max_ir >= i->fld_sz.height)
+        return 0;
+    for (n = 0; n < t->num_code; ++n)
+        if (op(i, t->code[n].row, t->code[n].col) != t->code[n].code)
+            return 0;
+    t->op_changes = i->op_changes;
+    return 1;
+}
+
+/* Points t->cells at the slots of a trace started with the data pointer
+   at (dr, dc). Returns 0 if the trace does not apply there. */
+static int place_trace(struct Interpreter *i, struct CompiledTrace *t,
+                       int dr, int dc)
+{
+    int n;
+
+    if (t->max_ir >= i->fld_sz.height ||
+        dr + t->min_dr < 0 || dr + t->max_dr >= i->fld_sz.height ||
+        dc + t->min_dc < 0 || dc + t->max_dc >= i->fld_sz.width)
+        return 0;
+
+    /* Written cells are made private first, as that may move chunks */
+    for (n = 0; n < t->num_slots; ++n)
+        if (t->slots[n].written)
+        {
+            if (trace_code(t, dr + t->slots[n].row, dc + t->slots[n].col,
+                           0) >= 0)
+                return 0;
+            writable(i, dr + t->slots[n].row, dc + t->slots[n].col);
+        }
+    for (n = 0; n < t->num_slots; ++n)
+        t->cells[n] = cell(i, dr + t->slots[n].row, dc + t->slots[n].col);
+    return 1;
+}
+
+#ifdef USE_JIT
+static void emit(unsigned char **p, const char *bytes, int n)
+{
+    memcpy(*p, bytes, n);
+    *p += n;
+}
+
+static void emit32(unsigned char **p, int value)
+{
+    memcpy(*p, &value, 4);
+    *p += 4;
+}
+
+/* Compiles a trace to a function that runs it like run_ops(). The cells
+   are loaded from the array in rdi for every operation; rsi points to the
+   iteration count, which is kept in rcx. Leaves t->native NULL if the code
+   cannot be mapped. */
+static void compile_trace(struct CompiledTrace *t)
+{
+    const struct TraceOp *o;
+    unsigned char *code, *p, *loop, *done, **exits;
+    size_t size;
+    int n, offset;
+
+    size = (64*(size_t)t->num_ops + 64 + 4095) & ~(size_t)4095;
+    code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return;
+    exits = malloc((t->num_ops + 1)*sizeof(*exits));
+    if (!exits)
+    {
+        munmap(code, size);
+        return;
+    }
+
+    p = code;
+    emit(&p, "\x48\x8b\x0e", 3);                /* mov rcx, [rsi] */
+    loop = p;
+    for (n = 0; n < t->num_ops; ++n)
+    {
+        o = &t->ops[n];
+        switch (o->kind)
+        {
+        case T_ADD:
+        case T_SUBTRACT:
+            emit(&p, "\x4c\x8b\x87", 3);        /* mov r8, [rdi + 8*src] */
+            emit32(&p, 8*o->src);
+            emit(&p, "\x41\x0f\xb6\x00", 4);    /* movzx eax, byte [r8] */
+            if (t->weight != 1)
+            {
+                emit(&p, "\x69\xc0", 2);        /* imul eax, eax, weight */
+                emit32(&p, t->weight);
+            }
+            if (o->kind == T_SUBTRACT)
+                emit(&p, "\xf7\xd8", 2);        /* neg eax */
+            emit(&p, "\x4c\x8b\x8f", 3);        /* mov r9, [rdi + 8*dst] */
+            emit32(&p, 8*o->dst);
+            emit(&p, "\x41\x00\x01", 3);        /* add [r9], al */
+            continue;
+        case T_CLEAR:
+            emit(&p, "\x4c\x8b\x8f", 3);        /* mov r9, [rdi + 8*dst] */
+            emit32(&p, 8*o->dst);
+            emit(&p, "\x41\xc6\x01\x00", 4);    /* mov byte [r9], 0 */
+            continue;
+        case T_ZERO:
+        case T_NONZERO:
+            emit(&p, "\x4c\x8b\x87", 3);        /* mov r8, [rdi + 8*src] */
+            emit32(&p, 8*o->src);
+            emit(&p, "\x41\x80\x38\x00", 4);    /* cmp byte [r8], 0 */
+            if (o->kind == T_ZERO)
+                emit(&p, "\x0f\x85", 2);        /* jne exit */
+            else
+                emit(&p, "\x0f\x84", 2);        /* je exit */
+            break;
+        }
+        exits[n] = p;
+        emit32(&p, 0);
+    }
+    emit(&p, "\x48\xff\xc9", 3);                /* dec rcx */
+    if (t->loop && t->exits[0].c.dr == 0 && t->exits[0].c.dc == 0)
+    {
+        emit(&p, "\x0f\x85", 2);                /* jnz loop */
+        emit32(&p, (int)(loop - (p + 4)));
+    }
+    emit(&p, "\x31\xc0", 2);                    /* xor eax, eax */
+    done = p;
+    emit(&p, "\x48\x89\x0e", 3);                /* mov [rsi], rcx */
+    emit(&p, "\xc3", 1);                        /* ret */
+    for (n = 0; n < t->num_ops; ++n)
+    {
+        if (t->ops[n].kind < T_ZERO)
+            continue;
+        offset = (int)(p - (exits[n] + 4));
+        memcpy(exits[n], &offset, 4);
+        emit(&p, "\xb8", 1);                    /* mov eax, n + 1 */
+        emit32(&p, n + 1);
+        emit(&p, "\xe9", 1);                    /* jmp done */
+        emit32(&p, (int)(done - (p + 4)));
+    }
+    free(exits);
+
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, size);
+        return;
+    }
+    t->native = (TraceCode)code;
+    t->native_size = size;
+}
+#endif
+
+/* Runs a placed trace for up to *iterations iterations, stopping after one
+   unless it loops in place. Returns the exit taken: 0 at the end of the
+   last iteration, otherwise 1 + the index of the guard that failed.
+   *iterations is decreased by the number of complete iterations. The
+   classes of the cells written are left for the caller to update. */
+static int run_ops(struct CompiledTrace *t, long *iterations)
+{
+    const struct TraceOp *o, *end = t->ops + t->num_ops;
+    char **cells = t->cells;
+    int again = t->loop && t->exits[0].c.dr == 0 && t->exits[0].c.dc == 0;
+
+#ifdef USE_JIT
+    if (t->native)
+        return t->native(cells, iterations);
+#endif
+    do {
+        for (o = t->ops; o != end; ++o)
+        {
+            switch (o->kind)
+            {
+            case T_ADD:
+                cells[o->dst][0] += t->weight*cells[o->src][0];
+                break;
+            case T_SUBTRACT:
+                cells[o->dst][0] -= t->weight*cells[o->src][0];
+                break;
+            case T_CLEAR:
+                cells[o->dst][0] = 0;
+                break;
+            case T_ZERO:
+                if (cells[o->src][0] != 0)
+                    return (int)(o - t->ops) + 1;
+                break;
+            case T_NONZERO:
+                if (cells[o->src][0] == 0)
+                    return (int)(o - t->ops) + 1;
+                break;
+            }
+        }
+    } while (--*iterations > 0 && again);
+    return 0;
+}
+
+/* Returns the trace starting at the single cursor, recording it if the
+   cursor's state has become hot, or NULL. */
+static struct CompiledTrace *find_trace(struct Interpreter *i)
+{
+    struct Cursor *c = &i->cursors[0];
+    struct CompiledTrace *t;
+    struct TraceEntry *e;
+
+    if (!i->traces)
+    {
+        i->traces = calloc(1, sizeof(struct TraceCache));
+        if (!i->traces)
+            return NULL;
+    }
+    e = i->traces->entries +
+        (cell_hash(c->ir, c->ic) + c->id) % TRACE_ENTRIES;
+    if (e->ir != c->ir || e->ic != c->ic || e->id != c->id ||
+        e->dm != c->dm || e->weight != c->weight)
+    {
+        free_trace(e->t);
+        memset(e, 0, sizeof(struct TraceEntry));
+        e->ir = c->ir;
+        e->ic = c->ic;
+        e->id = c->id;
+        e->dm = c->dm;
+        e->weight = c->weight;
+    }
+
+    /* Drop a trace whose code or field changed */
+    t = e->t;
+    if (t && (t->width != i->fld_sz.width ||
+              t->clear != (i->flags & F_CLEAR_MODE) ||
+              (t->op_changes != i->op_changes && !check_code(i, t))))
+    {
+        free_trace(t);
+        e->t = t = NULL;
+        e->hits = 0;
+    }
+    if (t)
+        return t;
+
+    if (e->skip > 0)
+    {
+        e->skip -= 1;
+        return NULL;
+    }
+    if (++e->hits < TRACE_HOT)
+        return NULL;
+    t = record_trace(i);
+    if (!t)
+    {
+        e->hits = 0;
+        e->backoff = e->backoff ? 2*e->backoff : 1;
+        if (e->backoff > 1024)
+            e->backoff = 1024;
+        e->skip = e->backoff;
+        return NULL;
+    }
+    mark_path(i->traces, t);
+    e->t = t;
+    e->backoff = 0;
+    t->op_changes = i->op_changes;
+#ifdef USE_JIT
+    compile_trace(t);
+#endif
+    return t;
+}
+
+/* Runs compiled traces for the single cursor at a branch, within
+   `max_steps' steps: the trace starting there, then the trace starting
+   where that one left off, and so on. States where traces end are
+   recorded like branches once they become hot. Returns the number of steps
+   taken, or 0 if there was no trace to run. */
+static int run_trace(struct Interpreter *i, int max_steps)
+{
+    struct Cursor *c = &i->cursors[0];
+    struct CompiledTrace *t;
+    struct TraceExit *x;
+    long iterations, left;
+    int exit, dr, dc, n, steps = 0;
+
+    if (op(i, c->ir, c->ic) != OP_BRANCH)
+        return 0;
+    while ((t = find_trace(i)) != NULL)
+    {
+        iterations = (max_steps - steps)/t->steps;
+        if (iterations == 0 || !place_trace(i, t, c->dr, c->dc))
+            break;
+        left = iterations;
+        exit = run_ops(t, &left);
+
+        /* Bring the classes of the cells written up to date */
+        dr = c->dr;
+        dc = c->dc;
+        for (n = 0; n < t->num_slots; ++n)
+            if (t->slots[n].written)
+                set_op(i, t->cells[n], dr + t->slots[n].row,
+                       dc + t->slots[n].col);
+
+        /* Move to the start of the iteration that took the exit */
+        x = &t->exits[0];
+        c->dr += (int)(iterations - left)*x->c.dr;
+        c->dc += (int)(iterations - left)*x->c.dc;
+        steps += (int)(iterations - left)*t->steps;
+        if (exit > 0)
+        {
+            x = &t->exits[exit];
+            c->dr += x->c.dr;
+            c->dc += x->c.dc;
+            steps += x->steps;
+        }
+        c->ir = x->c.ir;
+        c->ic = x->c.ic;
+        c->id = x->c.id;
+        c->dm = x->c.dm;
+
+        /* Let skip_loop() try loops first */
+        if (c->ir < 0 || c->ir >= i->fld_sz.height ||
+            (op(i, c->ir, c->ic) == OP_BRANCH && get(i, c->dr, c->dc) != 0))
+            break;
+    }
+    if (steps == 0)
+        return 0;
+
+    if (c->ir < 0 || c->ir >= i->fld_sz.height)
+    {
+        i->stats.kills[c->ir < 0 ? K_IP_TOP : K_IP_BOTTOM] += 1;
+        i->num_cursors = 0;
+        i->readers = 0;
+    }
+    else
+        i->readers = cursor_needs_input(i, c);
+    i->steps += steps;
+    return steps;
+}
+
+/* Skipping no-op cells. For every chunk, nops[n] holds four tables (one
+   per direction, indexed like DR and DC) with the number of consecutive
+   no-op cells starting at each cell: horizontally, wrapping around the
+   row and capped at 255; vertically, up to the edge of the chunk. Longer
+   runs are followed from table to table. The tables of a chunk are
+   rebuilt when they are needed after one of its cells changed between an
+   instruction and a no-op. Chunks without instructions need no tables. */
+#define NOP_MAX     255
+
+/* Returns the up-to-date no-op run lengths for chunk n, or NULL. */
+static unsigned char *nop_runs(struct Interpreter *i, int n)
+{
+    unsigned char *runs = i->nops[n], *p;
+    const char *ops = i->chunks[n] + PLANE(i);
+    int width = i->fld_sz.width, cap = i->fld_cap.width, tiled;
+    int r, c, pass, next;
+
+    if (!runs)
+    {
+        runs = i->nops[n] = malloc(4*PLANE(i));
+        if (!runs)
+            return NULL;
+        i->stale[n] = 1;
+    }
+    if (!i->stale[n])
+        return runs;
+
+    tiled = i->flags & F_TILED;
+#define NOP(r, c)   (ops[tiled ? chunk_offset(cap, 1, r, c) : (r)*cap + (c)] \
+                     == OP_NOP)
+    for (r = 0; r < CHUNK_ROWS; ++r)
+    {
+        /* Rightwards and leftwards, in two passes to wrap around */
+        p = runs + r*cap;
+        for (pass = 0, next = NOP_MAX; pass < 2; ++pass)
+            for (c = width - 1; c >= 0; --c)
+                next = p[c] = !NOP(r, c) ? 0 : next < NOP_MAX ? next + 1 : NOP_MAX;
+        p = runs + 2*PLANE(i) + r*cap;
+        for (pass = 0, next = NOP_MAX; pass < 2; ++pass)
+            for (c = 0; c < width; ++c)
+                next = p[c] = !NOP(r, c) ? 0 : next < NOP_MAX ? next + 1 : NOP_MAX;
+    }
+    for (c = 0; c < width; ++c)
+    {
+        /* Downwards and upwards, to the edge of the chunk */
+        p = runs + PLANE(i) + c;
+        for (r = CHUNK_ROWS - 1, next = 0; r >= 0; --r)
+            next = p[r*cap] = NOP(r, c) ? next + 1 : 0;
+        p = runs + 3*PLANE(i) + c;
+        for (r = 0, next = 0; r < CHUNK_ROWS; ++r)
+            next = p[r*cap] = NOP(r, c) ? next + 1 : 0;
+    }
+#undef NOP
+    i->stale[n] = 0;
+    return runs;
+}
+
+/* Returns the number of steps, up to `limit', that the cursor at `c' only
+   crosses no-op cells. A cursor that leaves the field on the last of these
+   steps is removed at the end of it. */
+static int nop_distance(struct Interpreter *i, const struct Cursor *c,
+                        int limit)
+{
+    const unsigned char *runs;
+    int n = 0, row = c->ir, col = c->ic, run, edge;
+
+    if (c->id & 1)
+    {
+        edge = c->id == 1 ? i->fld_sz.height - row : row + 1;
+        if (limit > edge)
+            limit = edge;
+        while (n < limit)
+        {
+            edge = row & (CHUNK_ROWS - 1);
+            edge = c->id == 1 ? CHUNK_ROWS - edge : edge + 1;
+            if (i->insns[row >> CHUNK_SHIFT] == 0)
+                run = edge;
+            else
+            {
+                runs = nop_runs(i, row >> CHUNK_SHIFT);
+                if (!runs)
+                    return 0;
+                run = runs[c->id*PLANE(i) +
+                           (row & (CHUNK_ROWS - 1))*i->fld_cap.width + col];
+            }
+            n += run;
+            if (run != edge)
+                break;
+            row += DR[c->id]*run;
+        }
+    }
+    else
+    {
+        if (i->insns[row >> CHUNK_SHIFT] == 0)
+            return limit;
+        runs = nop_runs(i, row >> CHUNK_SHIFT);
+        if (!runs)
+            return 0;
+        runs += c->id*PLANE(i) + (row & (CHUNK_ROWS - 1))*i->fld_cap.width;
+        while (n < limit)
+        {
+            run = runs[col];
+            n += run;
+            if (run < NOP_MAX)
+                break;
+            col = ((col + DC[c->id]*NOP_MAX) % i->fld_sz.width +
+                   i->fld_sz.width) % i->fld_sz.width;
+        }
+    }
+    return n < limit ? n : limit;
+}
+
+/* When every cursor is on a no-op cell, moves all cursors as far as they
+   can go together without executing an instruction, within `max_steps'
+   steps. Returns the number of steps skipped. */
+static int skip_nops(struct Interpreter *i, int max_steps)
+{
+    struct Cursor *c, *end, *next;
+    int k, distance, readers = 0, width = i->fld_sz.width;
+
+    end = i->cursors + i->num_cursors;
+    for (c = i->cursors; c != end; ++c)
+        if (op(i, c->ir, c->ic) != OP_NOP)
+            return 0;
+    k = max_steps;
+    for (c = i->cursors; c != end && k > 1; ++c)
+    {
+        distance = nop_distance(i, c, k);
+        if (distance < k)
+            k = distance;
+    }
+    if (k < 2)
+        return 0;
+
+    next = i->cursors;
+    for (c = i->cursors; c != end; ++c)
+    {
+        if (c->id & 1)
+        {
+            c->ir += DR[c->id]*k;
+            if (c->ir < 0 || c->ir >= i->fld_sz.height)
+            {
+                i->stats.kills[c->ir < 0 ? K_IP_TOP : K_IP_BOTTOM] += 1;
+                continue;
+            }
+        }
+        else
+            c->ic = ((c->ic + DC[c->id]*(k % width)) % width + width) % width;
+        if (next != c)
+            *next = *c;
+        readers += cursor_needs_input(i, next);
+        ++next;
+    }
+    i->num_cursors = next - i->cursors;
+    i->readers = readers;
+    i->steps += k;
+    return k;
+}
+
+/* Starts the undo log record of a step that reads `in'. */
+static void undo_begin(struct Interpreter *i, int in)
+{
+    struct History *h = i->history;
+    struct Cursor *c;
+    int n, value;
+
+    h->start = h->tail;
+    h->snapshot = h->head == h->tail || i->steps % UNDO_INTERVAL == 0;
+    for (n = 0; n < UNDO_HEADER; ++n)
+        undo_push(h, 0);
+    h->ring[(h->start + 1) % h->size] = i->fld_sz.height;
+    h->ring[(h->start + 3) % h->size] = in;
+    h->ring[(h->start + 4) % h->size] = h->snapshot ? i->num_cursors : -1;
+    if (!h->snapshot)
+        return;
+    for (n = 0; n < i->num_cursors; ++n)
+    {
+        c = &i->cursors[n];
+        undo_push(h, c->ir);
+        undo_push(h, c->ic);
+        undo_push(h, c->dr);
+        undo_push(h, c->dc);
+        undo_push(h, c->id | c->dm << 8 | c->weight << 16);
+    }
+    for (n = 0; n < UNDO_STATS; ++n)
+    {
+        memcpy(&value, (char *)&i->stats + n*sizeof(int), sizeof(int));
+        undo_push(h, value);
+    }
+}
+
+/* Completes the undo log record of a step. A step that does not fit in
+   the ring leaves the log empty. */
+static void undo_end(struct Interpreter *i, int flags)
+{
+    struct History *h = i->history;
+    int length = (int)(h->tail - h->start) + 1;
+
+    undo_push(h, length);
+    if (h->overflow)
+    {
+        h->head = h->tail = h->start;
+        h->overflow = 0;
+        return;
+    }
+    h->ring[h->start % h->size] = length;
+    h->ring[(h->start + 2) % h->size] = flags;
+}
+
+/* Makes room for the counts of rows [0, height) of a field `width' cells
+   wide. The counts of existing cells are kept if the width changes. */
+static int profile_resize(struct Profile *p, int height, int width)
+{
+    struct CellCounts *cells = p->cells, *rows;
+    int cap = p->cap, r;
+
+    if (height > cap || width != p->width)
+    {
+        while (cap < height)
+            cap = cap ? 2*cap : 64;
+        cells = calloc((size_t)cap*width, sizeof(struct CellCounts));
+        rows = realloc(p->rows, cap*sizeof(struct CellCounts));
+        if (!cells || !rows)
+        {
+            free(cells);
+            if (rows)
+                p->rows = rows;
+            return 0;
+        }
+        memset(rows + p->cap, 0, (cap - p->cap)*sizeof(struct CellCounts));
+        for (r = 0; r < p->height; ++r)
+            memcpy(cells + r*width, p->cells + r*p->width,
+                   (width < p->width ? width : p->width)*
+                   sizeof(struct CellCounts));
+        free(p->cells);
+        p->cells = cells;
+        p->rows = rows;
+        p->cap = cap;
+        p->width = width;
+    }
+    if (height > p->height)
+        p->height = height;
+    return 1;
+}
+
+/* Adds `weight' to the reads or writes of a cell and its row. */
+static void count_access(struct Interpreter *i, int row, int col, int write,
+                         int weight)
+{
+    struct Profile *p = i->profile;
+
+    if (row >= p->height && !profile_resize(p, row + 1, p->width))
+        return;
+    if (write)
+    {
+        p->cells[row*p->width + col].writes += weight;
+        p->rows[row].writes += weight;
+    }
+    else
+    {
+        p->cells[row*p->width + col].reads += weight;
+        p->rows[row].reads += weight;
+    }
+}
+
+/* Counts the instructions that the cursors are about to execute, and the
+   cells their data pointers will access. */
+static void profile_step(struct Interpreter *i, int in)
+{
+    struct Profile *p = i->profile;
+    struct Cursor *c;
+    int n, code, weight, row, col;
+
+    if (!profile_resize(p, i->fld_sz.height, i->fld_sz.width))
+        return;
+    for (n = 0; n < i->num_cursors; ++n)
+    {
+        c = &i->cursors[n];
+        weight = c->weight ? c->weight : 256;
+        p->cells[c->ir*p->width + c->ic].visits[c->id] += weight;
+        p->rows[c->ir].visits[c->id] += weight;
+
+        code = op(i, c->ir, c->ic);
+        if (code == OP_BRANCH)
+            count_access(i, c->dr, c->dc, 0, weight);
+        if (code < OP_RIGHT || code > OP_HERE || c->dm == M_NONE ||
+            (code == OP_UP && c->dr == 0))
+            continue;
+
+        /* Data operation from (dr, dc) to (row, col) */
+        row = c->dr;
+        col = c->dc;
+        if (code != OP_HERE)
+        {
+            row += DR[code - OP_RIGHT];
+            col = (col + DC[code - OP_RIGHT] + p->width) % p->width;
+        }
+        switch (c->dm)
+        {
+        case M_ADD:
+        case M_SUBTRACT:
+            count_access(i, c->dr, c->dc, 0, weight);
+            count_access(i, row, col, 1, weight);
+            break;
+        case M_INPUT:
+            if ((in & ~255) == 0)
+                count_access(i, row, col, 1, weight);
+            break;
+        case M_OUTPUT:
+            count_access(i, c->dr, c->dc, 0, weight);
+            break;
+        case M_CLEAR:
+            if (i->flags & F_CLEAR_MODE)
+                count_access(i, row, col, 1, weight);
+            break;
+        }
+    }
+}
+
+/* Marks the cells the cursors are about to execute in the visit bitmap. */
+static void visit_step(struct Interpreter *i)
+{
+    int n, bit;
+
+    for (n = 0; n < i->num_cursors; ++n)
+    {
+        bit = interpreter_visit_bit(i->cursors[n].ir, i->cursors[n].ic,
+                                    i->visit_bits);
+        i->visits[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+/* Runs a single step, recording it in the undo log if there is one. */
+static int step(struct Interpreter *i, int in, int *out)
+{
+    int status, flags = 0;
+
+    if (i->profile)
+        profile_step(i, in);
+    if (i->visits)
+        visit_step(i);
+    if (i->history)
+    {
+        if (in >= 0 && interpreter_needs_input(i))
+            flags = I_INPUT;
+        undo_begin(i, in);
+    }
+    i->steps += 1;
+    if (i->num_cursors == 1 && !(i->flags & F_NO_SINGLE))
+        status = step_single(i, in, out);
+    else
+        status = step_cursors(i, in, out);
+    if (i->history)
+        undo_end(i, flags | (status & I_OUTPUT));
+    if (status & I_OUTPUT)
+        i->stats.output += 1;
+    return status;
+}
+
+/* Returns the time in seconds from a monotonic clock (processor time on
+   Windows, where the interpreter runs on a single thread). */
+static double seconds()
+{
+#ifdef _MSC_VER
+    return (double)clock()/CLOCKS_PER_SEC;
+#else
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+#endif
+}
+
+int interpreter_step(struct Interpreter *i, int in, int *out)
+{
+    if (i->num_cursors == 0)
+        return I_EXIT;
+    return step(i, in, out);
+}
+
+/* Runs up to `max_steps' steps, reading input from `in_buf' (in_len bytes)
+   and writing output to `out_buf' (out_cap bytes). Stops early when the
+   program ends, when the next step requires input and all input has been
+   consumed, or when the output buffer is full. With in_buf NULL, input is
+   at end of file: steps that read input run without it. The number of
+   bytes read and written is stored in *consumed and *produced.
+
+   Returns I_EXIT when no cursors are left, I_ERROR on failure, and
+   otherwise I_INPUT if the next step requires input, combined with
+   I_OUTPUT if any output was produced. */
+int interpreter_run(struct Interpreter *i, int max_steps,
+                    const char *in_buf, int in_len, char *out_buf, int out_cap,
+                    int *consumed, int *produced)
+{
+    int status, in, out, n, skipped, wait = 0, backoff = 0;
+    int read = 0, written = 0;
+    long long steps = i->steps;
+    double start = seconds();
+
+    status = interpreter_needs_input(i) ? I_INPUT : I_SUCCESS;
+    for (n = 0; n < max_steps && i->num_cursors > 0; ++n)
+    {
+        if (written == out_cap)
+            break;
+
+        /* Steps are only skipped when they need not be undone or counted */
+        if (i->history || i->profile || i->visits || (i->flags & F_NO_SKIP))
+            goto run;
+        if (i->num_cursors == 1 && (skipped = skip_loop(i, max_steps - n)) > 0)
+        {
+            n += skipped - 1;
+            status = I_SUCCESS;
+            continue;
+        }
+        /* Compiled traces write cells without journaling them */
+        if (i->num_cursors == 1 && !(i->flags & F_NO_JIT) && !i->journal &&
+            (skipped = run_trace(i, max_steps - n)) > 0)
+        {
+            n += skipped - 1;
+            status = interpreter_needs_input(i) ? I_INPUT : I_SUCCESS;
+            continue;
+        }
+
+        /* With many cursors, a failed attempt to skip no-ops is only
+           retried after a number of steps that doubles each time. */
+        if (wait > 0)
+            wait -= 1;
+        else
+        if ((skipped = skip_nops(i, max_steps - n)) > 0)
+        {
+            n += skipped - 1;
+            status = interpreter_needs_input(i) ? I_INPUT : I_SUCCESS;
+            backoff = 0;
+            continue;
+        }
+        else
+        if (i->num_cursors > 1)
+        {
+            backoff = backoff ? 2*backoff : 1;
+            if (backoff > 64)
+                backoff = 64;
+            wait = backoff;
+        }
+run:
+        in = -1;
+        if ((status & I_INPUT) && in_buf)
+        {
+            if (read == in_len)
+                break;
+            in = (unsigned char)in_buf[read++];
+        }
+        status = step(i, in, &out);
+        if (status & I_ERROR)
+            break;
+        if (status & I_OUTPUT)
+            out_buf[written++] = out;
+    }
+    *consumed = read;
+    *produced = written;
+    i->stats.timed_steps += i->steps - steps;
+    i->stats.seconds += seconds() - start;
+    if (i->num_cursors == 0)
+        return I_EXIT;
+    if (status & I_ERROR)
+        return I_ERROR;
+    return (status & I_INPUT) | (written > 0 ? I_OUTPUT : 0);
+}
+
+/* Runs up to `max_steps' steps like interpreter_run(), with input and
+   output through the callbacks of `s' (see struct Stream). Input is only
+   read when the next step requires it, and output is written at least
+   every STREAM_STEPS steps. Returns I_EXIT when no cursors are left,
+   I_ERROR on failure (including a failed write), and otherwise I_INPUT if
+   the next step requires input: when the read callback had none available
+   yet, the run stops early and can be resumed with the same stream. */
+int interpreter_run_stream(struct Interpreter *i, long long max_steps,
+                           struct Stream *s)
+{
+    char out[STREAM_BUFFER];
+    const char *in;
+    long long steps;
+    int status, consumed, produced, got;
+
+    while (max_steps > 0)
+    {
+        steps = i->steps;
+        in = s->eof ? NULL : s->buf + s->pos;
+        status = interpreter_run(i, max_steps > STREAM_STEPS ? STREAM_STEPS
+                                                             : (int)max_steps,
+                                 in, s->len - s->pos, out, sizeof(out),
+                                 &consumed, &produced);
+        s->pos += consumed;
+        max_steps -= i->steps - steps;
+        if (produced > 0 && !s->write(s->arg, out, produced))
+            return I_ERROR;
+        if (status == I_EXIT || status == I_ERROR)
+            return status;
+        if ((status & I_INPUT) && s->pos == s->len && !s->eof)
+        {
+            got = s->read(s->arg, s->buf, sizeof(s->buf));
+            if (got < 0)
+                return I_INPUT;
+            s->pos = 0;
+            s->len = got;
+            s->eof = got == 0;
+        }
+    }
+    if (i->num_cursors == 0)
+        return I_EXIT;
+    return interpreter_needs_input(i) ? I_INPUT : I_SUCCESS;
+}
+
+struct Size interpreter_size(struct Interpreter *i)
+{
+    return i->fld_sz;
+}
+
+/* Sets the number of threads used to run cursors. Steps with few cursors
+   always run on the calling thread only. Returns the number of threads
+   actually available. */
+int interpreter_set_threads(struct Interpreter *i, int threads)
+{
+#ifdef USE_THREADS
+    destroy_pool(i->pool);
+    i->pool = NULL;
+    if (threads > 1)
+        i->pool = create_pool(i, threads);
+    return i->pool ? i->pool->num_workers : 1;
+#else
+    (void)i;
+    (void)threads;
+    return 1;
+#endif
+}
+
+/* Grows the field to at least the given size. */
+void interpreter_resize(struct Interpreter *i, struct Size size)
+{
+    ensure(i, size.height, size.width);
+}
+
+/* Returns whether the next step reads input. The steps keep the number
+   of cursors that will read up to date, so the cursors are only counted
+   again after the cells or cursors were changed some other way. */
+int interpreter_needs_input(struct Interpreter *i)
+{
+    if (i->readers < 0)
+        i->readers = count_readers(i);
+    return i->readers > 0;
+}
+
+struct Interpreter *interpreter_create()
+{
+    struct Interpreter *i;
+
+    i = malloc(sizeof(struct Interpreter));
     if (!i)
         goto failed;
     memset(i, 0, sizeof(struct Interpreter));
 
     /* Allocate initial cursor */
-    i->cursors = malloc(sizeof(struct Cursor));
-    if (!i->cursors)
+    if (!reserve_cursors(i, 1))
         goto failed;
     memset(i->cursors, 0, sizeof(struct Cursor));
+    i->cursors[0].weight = 1;
+    i->num_cursors = 1;
+    i->readers = 0;
+    i->stats.peak_cursors = 1;
 
     /* Set initial 1x1 field */
     ensure(i, 1, 1);
@@ -334,34 +3056,55 @@ failed:
 struct Interpreter *interpreter_clone(struct Interpreter *i)
 {
     struct Interpreter *j;
-    struct Cursor *c, *d;
+    int n;
 
     j = malloc(sizeof(struct Interpreter));
     if (!j)
         goto failed;
     memset(j, 0, sizeof(struct Interpreter));
 
-    /* Duplicate flags */
+    /* Duplicate flags (the clone runs on a single thread) */
     j->flags = i->flags;
 
     /* Duplicate cursors */
-    for (c = i->cursors; c; c = c->next)
+    if (!reserve_cursors(j, i->cap_cursors))
+        goto failed;
+    memcpy(j->cursors, i->cursors, i->num_cursors*sizeof(struct Cursor));
+    j->num_cursors = i->num_cursors;
+    j->readers = i->readers;
+    j->steps = i->steps;
+    j->stats = i->stats;
+
+    /* Share field chunks until either interpreter writes to them */
+    j->chunks = malloc(i->num_chunks*sizeof(char *));
+    j->nops = calloc(i->num_chunks, sizeof(unsigned char *));
+    j->stale = malloc(i->num_chunks);
+    j->insns = malloc(i->num_chunks*sizeof(int));
+    j->shared = malloc(i->num_chunks);
+    if (!j->chunks || !j->nops || !j->stale || !j->insns || !j->shared)
+        goto failed;
+    memset(j->stale, 1, i->num_chunks);
+    memcpy(j->insns, i->insns, i->num_chunks*sizeof(int));
+    memset(j->shared, 1, i->num_chunks);
+    memset(i->shared, 1, i->num_chunks);
+    j->num_chunks = j->cap_chunks = i->num_chunks;
+    for (n = 0; n < i->num_chunks; ++n)
     {
-        d = malloc(sizeof(struct Cursor));
-        if (!d)
-            goto failed;
-        memcpy(d, c, sizeof(struct Cursor));
-        d->next = j->cursors;
-        j->cursors = d;
+        j->chunks[n] = i->chunks[n];
+        if (REF_LOAD(*chunk_refs(j->chunks[n])) != 0)
+            REF_ADD(*chunk_refs(j->chunks[n]), 1);
+    }
+    if (i->mapping)
+    {
+        j->mapping = i->mapping;
+        REF_ADD(j->mapping->refs, 1);
     }
-
-    /* Duplicate field */
     j->fld_sz  = i->fld_sz;
     j->fld_cap = i->fld_cap;
-    j->field = malloc(j->fld_cap.height * j->fld_cap.width);
-    if (!j->field)
+
+    /* The clone starts with an empty journal */
+    if (i->journal && !journal(j, 1))
         goto failed;
-    memcpy(j->field, i->field, j->fld_cap.height * j->fld_cap.width);
 
     return j;
 
@@ -372,28 +3115,357 @@ failed:
 
 void interpreter_destroy(struct Interpreter *i)
 {
-    struct Cursor *c, *next;
-
-    c = i->cursors;
-    while (c)
+    if (!i)
+        return;
+#ifdef USE_THREADS
+    destroy_pool(i->pool);
+    i->pool = NULL;
+#endif
+    free(i->cursors);
+    i->cursors = NULL;
+    free(i->spare);
+    i->spare = NULL;
+    free(i->effects);
+    i->effects = NULL;
+    free(i->slots);
+    i->slots = NULL;
+    free(i->waiting);
+    i->waiting = NULL;
+    free(i->loops);
+    i->loops = NULL;
+    journal(i, 0);
+    interpreter_set_history(i, 0);
+    while (i->num_chunks > 0)
     {
-        next = c->next;
-        free(c);
-        c = next;
+        i->num_chunks -= 1;
+        chunk_release(i->chunks[i->num_chunks]);
+        free(i->nops[i->num_chunks]);
     }
-    i->cursors = NULL;
-    free(i->field);
-    i->field = NULL;
+    free(i->chunks);
+    i->chunks = NULL;
+    free_traces(i);
+    free(i->nops);
+    i->nops = NULL;
+    free(i->stale);
+    i->stale = NULL;
+    free(i->insns);
+    i->insns = NULL;
+    free(i->shared);
+    i->shared = NULL;
+    mapping_release(i->mapping);
+    i->mapping = NULL;
+    interpreter_set_profiling(i, 0);
+    interpreter_set_visits(i, 0);
     free(i);
 }
 
+/* Checkpoints. A checkpoint file starts with this header, in the byte
+   order and structure layout of the machine that wrote it, followed by
+   the cursors (as struct Cursor, in order), the number of instruction
+   cells in each chunk (as int) and, aligned to CHECKPOINT_ALIGN, the field
+   chunks exactly as they are kept in memory, each preceded by CHUNK_HEADER
+   zero bytes. A checkpoint can therefore be mapped into memory and run
+   from directly, without reading the field first. */
+struct CheckpointHeader {
+    char magic[8];              /* CHECKPOINT_MAGIC */
+    int version;                /* CHECKPOINT_VERSION */
+    int byte_order;             /* 0x01020304 */
+    int header_size;            /* sizeof(struct CheckpointHeader) */
+    int cursor_size;            /* sizeof(struct Cursor) */
+    int chunk_rows, chunk_header;
+    int flags;
+    struct Size size;           /* fld_sz */
+    int row_size;               /* fld_cap.width */
+    int num_chunks, num_cursors;
+    long long steps;
+    struct IOState io;
+    long long cursors_at, insns_at, chunks_at;  /* file offsets */
+};
+
+#ifndef NO_STDIO
+/* Writes `n' zero bytes. */
+static int write_zeros(FILE *fp, long long n)
+{
+    static const char zeros[256];
+
+    for (; n > 0; n -= sizeof(zeros))
+        if (!fwrite(zeros, n < (long long)sizeof(zeros) ? (size_t)n
+                                                        : sizeof(zeros), 1, fp))
+            return 0;
+    return 1;
+}
+
+/* Saves the complete state of the interpreter, along with the I/O state
+   `io' (if not NULL), in a checkpoint file. The file is written under a
+   temporary name first, so an existing checkpoint is only replaced by a
+   complete one. Returns 0 on failure. */
+int interpreter_save(struct Interpreter *i, const char *filepath,
+                     const struct IOState *io)
+{
+    struct CheckpointHeader h;
+    FILE *fp;
+    char *tmp;
+    long long pos;
+    int n, ok;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.version = CHECKPOINT_VERSION;
+    h.byte_order = 0x01020304;
+    h.header_size = sizeof(h);
+    h.cursor_size = sizeof(struct Cursor);
+    h.chunk_rows = CHUNK_ROWS;
+    h.chunk_header = CHUNK_HEADER;
+    h.flags = i->flags;
+    h.size = i->fld_sz;
+    h.row_size = i->fld_cap.width;
+    h.num_chunks = i->num_chunks;
+    h.num_cursors = i->num_cursors;
+    h.steps = i->steps;
+    if (io)
+        h.io = *io;
+    h.cursors_at = sizeof(h);
+    h.insns_at = h.cursors_at + i->num_cursors*sizeof(struct Cursor);
+    h.chunks_at = h.insns_at + i->num_chunks*sizeof(int);
+    h.chunks_at = (h.chunks_at + CHECKPOINT_ALIGN - 1) & -CHECKPOINT_ALIGN;
+
+    tmp = malloc(strlen(filepath) + 5);
+    if (!tmp)
+        return 0;
+    sprintf(tmp, "%s.tmp", filepath);
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        free(tmp);
+        return 0;
+    }
+    ok = fwrite(&h, sizeof(h), 1, fp) &&
+         fwrite(i->cursors, sizeof(struct Cursor), i->num_cursors, fp) ==
+            (size_t)i->num_cursors &&
+         fwrite(i->insns, sizeof(int), i->num_chunks, fp) ==
+            (size_t)i->num_chunks;
+    pos = h.insns_at + i->num_chunks*sizeof(int);
+    ok = ok && write_zeros(fp, h.chunks_at - pos);
+    for (n = 0; ok && n < i->num_chunks; ++n)
+        ok = write_zeros(fp, CHUNK_HEADER) &&
+             fwrite(i->chunks[n], 2*PLANE(i), 1, fp);
+    ok = fclose(fp) == 0 && ok;
+#ifdef _MSC_VER
+    if (ok)
+        remove(filepath);
+#endif
+    ok = ok && rename(tmp, filepath) == 0;
+    if (!ok)
+        remove(tmp);
+    free(tmp);
+    return ok;
+}
+
+/* Replaces the I/O state saved in a checkpoint file, such as to count
+   output written since the checkpoint. The rest of the file is left as it
+   is, so an interpreter running from its image is unaffected. Returns 0 on
+   failure. */
+int interpreter_save_io(const char *filepath, const struct IOState *io)
+{
+    struct CheckpointHeader h;
+    FILE *fp;
+    int ok;
+
+    fp = fopen(filepath, "r+b");
+    if (!fp)
+        return 0;
+    ok = fread(&h, sizeof(h), 1, fp) &&
+         memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) == 0 &&
+         h.version == CHECKPOINT_VERSION && h.header_size == sizeof(h);
+    h.io = *io;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp);
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+/* Creates an interpreter from a checkpoint file image, whose chunks are
+   used in place. The header and cursors are checked, but the field is
+   taken as it was saved: only pages that are run or written are read. */
+static struct Interpreter *from_image(struct Mapping *m, struct IOState *io)
+{
+    struct CheckpointHeader h;
+    struct Interpreter *i;
+    struct Cursor *c;
+    long long stride;
+    int n, plane;
+
+    if (m->size < sizeof(h))
+        return NULL;
+    memcpy(&h, m->addr, sizeof(h));
+    if (memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != CHECKPOINT_VERSION || h.byte_order != 0x01020304 ||
+        h.header_size != sizeof(h) || h.cursor_size != sizeof(struct Cursor) ||
+        h.chunk_rows != CHUNK_ROWS || h.chunk_header != CHUNK_HEADER)
+        return NULL;
+    stride = CHUNK_HEADER + 2LL*CHUNK_ROWS*h.row_size;
+    if (h.row_size < 16 || (h.row_size & (h.row_size - 1)) != 0 ||
+        h.num_chunks < 1 || h.num_cursors < 0 ||
+        h.size.width < 1 || h.size.width > h.row_size || h.size.height < 1 ||
+        h.size.height > (long long)h.num_chunks*CHUNK_ROWS ||
+        h.cursors_at < (long long)sizeof(h) || h.cursors_at +
+            h.num_cursors*(long long)sizeof(struct Cursor) > (long long)m->size ||
+        h.insns_at < (long long)sizeof(h) || h.insns_at +
+            h.num_chunks*(long long)sizeof(int) > (long long)m->size ||
+        h.chunks_at < (long long)sizeof(h) || h.chunks_at % 16 != 0 ||
+        h.chunks_at + h.num_chunks*stride > (long long)m->size)
+        return NULL;
+    plane = CHUNK_ROWS*h.row_size;
+
+    i = malloc(sizeof(struct Interpreter));
+    if (!i)
+        return NULL;
+    memset(i, 0, sizeof(struct Interpreter));
+    if (!reserve_cursors(i, h.num_cursors > 0 ? h.num_cursors : 1))
+        goto failed;
+    memcpy(i->cursors, m->addr + h.cursors_at,
+           h.num_cursors*sizeof(struct Cursor));
+    for (n = 0; n < h.num_cursors; ++n)
+    {
+        c = &i->cursors[n];
+        if (c->ir < 0 || c->ir >= h.size.height ||
+            c->ic < 0 || c->ic >= h.size.width ||
+            c->dr < 0 || c->dr >= h.size.height ||
+            c->dc < 0 || c->dc >= h.size.width ||
+            c->id > 3 || c->dm > M_CLEAR)
+            goto failed;
+    }
+    i->num_cursors = h.num_cursors;
+    i->readers = -1;
+    i->steps = h.steps;
+
+    i->chunks = malloc(h.num_chunks*sizeof(char *));
+    i->nops = calloc(h.num_chunks, sizeof(unsigned char *));
+    i->stale = malloc(h.num_chunks);
+    i->insns = malloc(h.num_chunks*sizeof(int));
+    i->shared = malloc(h.num_chunks);
+    if (!i->chunks || !i->nops || !i->stale || !i->insns || !i->shared)
+        goto failed;
+    memset(i->stale, 1, h.num_chunks);
+    memset(i->shared, 1, h.num_chunks);
+    memcpy(i->insns, m->addr + h.insns_at, h.num_chunks*sizeof(int));
+    for (n = 0; n < h.num_chunks; ++n)
+    {
+        i->chunks[n] = m->addr + h.chunks_at + n*stride + CHUNK_HEADER;
+        i->num_chunks = n + 1;
+        if (i->insns[n] < 0 || i->insns[n] > plane ||
+            *chunk_refs(i->chunks[n]) != 0)
+            goto failed;
+    }
+    i->cap_chunks = h.num_chunks;
+    i->mapping = m;
+    i->fld_sz = h.size;
+    i->fld_cap.width = h.row_size;
+    i->fld_cap.height = h.num_chunks*CHUNK_ROWS;
+    i->flags = h.flags & F_TILED;
+    if (interpreter_set_flags(i, h.flags) != (h.flags & F_ALL))
+        goto failed;
+    if (io)
+        *io = h.io;
+    return i;
+
+failed:
+    i->mapping = NULL;
+    interpreter_destroy(i);
+    return NULL;
+}
+
+/* Resumes an interpreter from a checkpoint file written by
+   interpreter_save(), and stores the saved I/O state in *io (if io is not
+   NULL). Where possible, the file is mapped into memory and its field
+   chunks are only copied when they are written to. Returns NULL if the
+   file cannot be read or is not a valid checkpoint for this build. */
+struct Interpreter *interpreter_load(const char *filepath, struct IOState *io)
+{
+    struct Interpreter *i;
+    struct Mapping *m;
+    FILE *fp;
+    long size;
+
+    m = malloc(sizeof(struct Mapping));
+    if (!m)
+        return NULL;
+    memset(m, 0, sizeof(struct Mapping));
+    m->refs = 1;
+#ifdef USE_MMAP
+    {
+        struct stat st;
+        int fd = open(filepath, O_RDONLY);
+
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            m->addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+            if (m->addr == MAP_FAILED)
+                m->addr = NULL;
+            else
+            {
+                m->size = st.st_size;
+                m->mapped = 1;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+#endif
+    if (!m->addr)
+    {
+        /* Read the whole file instead */
+        fp = fopen(filepath, "rb");
+        if (!fp)
+        {
+            free(m);
+            return NULL;
+        }
+        if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 &&
+            fseek(fp, 0, SEEK_SET) == 0 && (m->addr = malloc(size)) != NULL &&
+            fread(m->addr, size, 1, fp))
+            m->size = size;
+        fclose(fp);
+    }
+    i = m->size > 0 ? from_image(m, io) : NULL;
+    if (!i)
+    {
+        m->refs = 1;
+        mapping_release(m);
+    }
+    return i;
+}
+
+#endif /* ndef NO_STDIO */
+
+/* Copies source code into the field, continuing at (*row, *col). */
+static void put_source(struct Interpreter *i, const char *buf, size_t size,
+                       char nul, int *row, int *col)
+{
+    size_t n;
+
+    for (n = 0; n < size; ++n)
+    {
+        if (buf[n] == '\n')
+        {
+            *col = 0;
+            *row += 1;
+            continue;
+        }
+        ensure(i, *row + 1, *col + 1);
+        set(i, *row, *col, buf[n] == nul ? 0 : buf[n]);
+        *col += 1;
+    }
+}
+
+#ifndef NO_STDIO
 struct Interpreter *interpreter_from_source(const char *filepath, char nul)
 {
     struct Interpreter *i;
     FILE *fp;
     char buf[512];
     size_t read;
-    int row, col, n;
+    int row, col;
 
     fp = fopen(filepath, "rt");
     if (!fp)
@@ -407,29 +3479,37 @@ struct Interpreter *interpreter_from_source(const char *filepath, char nul)
     }
     row = col = 0;
     while ((read = fread(buf, 1, sizeof(buf), fp)) > 0)
-    {
-        for (n = 0; n < (int)read; ++n)
-        {
-            if (buf[n] == '\n')
-            {
-                col = 0;
-                row += 1;
-                continue;
-            }
-            ensure(i, row + 1, col + 1);
-            set(i, row, col, buf[n] == nul ? 0 : buf[n]);
-            col += 1;
-        }
-    }
+        put_source(i, buf, read, nul, &row, &col);
     fclose(fp);
     return i;
 }
+#endif /* ndef NO_STDIO */
+
+/* Creates an interpreter from source code in memory (see README.md), with
+   `nul' standing for zero cells. Returns NULL on failure. */
+struct Interpreter *interpreter_from_memory(const char *data, size_t size,
+                                            char nul)
+{
+    struct Interpreter *i;
+    int row = 0, col = 0;
+
+    i = interpreter_create();
+    if (i)
+        put_source(i, data, size, nul, &row, &col);
+    return i;
+}
 
+/* Returns the value of cell (row, col), or 0 outside the field. */
 char interpreter_get(struct Interpreter *i, int row, int col)
 {
+    if (row < 0 || row >= i->fld_sz.height ||
+        col < 0 || col >= i->fld_sz.width)
+        return 0;
     return get(i, row, col);
 }
 
+/* Sets or adds to cell (row, col), which must lie within the field (see
+   interpreter_resize()). */
 void interpreter_set(struct Interpreter *i, int row, int col, char value)
 {
     set(i, row, col, value);
@@ -440,6 +3520,32 @@ void interpreter_add(struct Interpreter *i, int row, int col, int value)
     add(i, row, col, value);
 }
 
+int interpreter_num_cursors(struct Interpreter *i)
+{
+    return i->num_cursors;
+}
+
+/* Copies cursor n (in execution order) to *c. Returns 0 if there is no
+   such cursor. */
+int interpreter_get_cursor(struct Interpreter *i, int n, struct Cursor *c)
+{
+    if (n < 0 || n >= i->num_cursors)
+        return 0;
+    *c = i->cursors[n];
+    return 1;
+}
+
+/* Replaces cursor n with *c, whose position must lie within the field.
+   Returns 0 if there is no such cursor. */
+int interpreter_set_cursor(struct Interpreter *i, int n,
+                           const struct Cursor *c)
+{
+    if (n < 0 || n >= i->num_cursors)
+        return 0;
+    i->cursors[n] = *c;
+    i->readers = -1;
+    return 1;
+}
 
 int interpreter_get_flags(struct Interpreter *i)
 {
@@ -448,10 +3554,319 @@ int interpreter_get_flags(struct Interpreter *i)
 
 int interpreter_set_flags(struct Interpreter *i, int flags)
 {
-    return i->flags = (flags & F_ALL);
+    flags &= F_ALL;
+    if ((flags ^ i->flags) & F_TILED)
+        relayout(i, flags & F_TILED);
+    if (!journal(i, flags & F_JOURNAL))
+        flags &= ~F_JOURNAL;
+    return i->flags = flags;
 }
 
 int interpreter_add_flags(struct Interpreter *i, int flags)
 {
-    return i->flags |= (flags & F_ALL);
+    return interpreter_set_flags(i, i->flags | flags);
+}
+
+/* Calls cb(arg, row, col) for the cells changed after `epoch' (a value
+   returned by an earlier call, or 0), in the order of the changes; a cell
+   may be reported more than once. When too many cells changed to be
+   listed, rows that changed are reported as a whole, with col = -1.
+   A NULL cb only queries the current epoch. Returns the current epoch, or
+   -1 if changes are not recorded (F_JOURNAL is not set). */
+long long interpreter_changes_since(struct Interpreter *i, long long epoch,
+                                    void (*cb)(void *arg, int row, int col),
+                                    void *arg)
+{
+    struct Journal *j = i->journal;
+    int n;
+
+    if (!j)
+        return -1;
+    if (!cb || epoch >= j->epoch)
+        return j->epoch;
+    if (epoch >= 0 && j->epoch - epoch <= JOURNAL_SIZE)
+    {
+        for (; epoch < j->epoch; ++epoch)
+        {
+            n = (int)(epoch % JOURNAL_SIZE);
+            cb(arg, j->cells[n].row, j->cells[n].col);
+        }
+    }
+    else
+    {
+        for (n = 0; n < i->fld_sz.height; ++n)
+            if (j->rows[n] > epoch)
+                cb(arg, n, -1);
+    }
+    return j->epoch;
+}
+
+/* Keeps an undo log of up to `size' ints (about 24 bytes per step and 8
+   bytes per changed cell, plus 20 bytes per cursor every UNDO_INTERVAL
+   steps), so that interpreter_step_back() can undo the most recent steps.
+   A size of 0 stops recording. While the log is kept, interpreter_run()
+   executes every step individually. Clones do not inherit the log.
+   Returns 0 if the log could not be allocated. */
+int interpreter_set_history(struct Interpreter *i, int size)
+{
+    if (i->history)
+        free(i->history->ring);
+    free(i->history);
+    i->history = NULL;
+    if (size <= 0)
+        return 1;
+    i->history = malloc(sizeof(struct History));
+    if (!i->history)
+        return 0;
+    memset(i->history, 0, sizeof(struct History));
+    i->history->ring = malloc(size*sizeof(int));
+    if (!i->history->ring)
+    {
+        interpreter_set_history(i, 0);
+        return 0;
+    }
+    i->history->size = size;
+    return 1;
+}
+
+/* Undoes the most recent step in the undo log. The cells it changed are
+   restored, and the cursors and engine counters are taken from the last
+   snapshot, after which the steps that followed it are run again. The
+   time spent and the field reallocations are not undone. Returns I_ERROR
+   if there is no step to undo, and otherwise I_INPUT if the step consumed
+   input, combined with I_OUTPUT if it produced output. */
+int interpreter_step_back(struct Interpreter *i)
+{
+    struct History *h = i->history;
+    struct Profile *profile;
+    struct Stats stats;
+    struct Cursor *c;
+    long long start, end, rec, pos;
+    int n, num, packed, flags, count, out, *ring;
+    int in[UNDO_INTERVAL];
+
+    if (!h || h->tail == h->head)
+        return I_ERROR;
+    ring = h->ring;
+    flags = ring[(h->tail - ring[(h->tail - 1) % h->size] + 2) % h->size];
+
+    /* Find the last snapshot, and the input of the steps after it */
+    start = h->tail;
+    count = 0;
+    do
+    {
+        start -= ring[(start - 1) % h->size];
+        num = ring[(start + 4) % h->size];
+        if (count > 0)
+            in[count - 1] = ring[(start + 3) % h->size];
+        count += 1;
+    }
+    while (num < 0 && count < UNDO_INTERVAL);
+    assert(num >= 0 && start >= h->head);
+    if (!reserve_cursors(i, num))
+        return I_ERROR;
+
+    /* Restore the cells in reverse order, without logging the changes */
+    i->history = NULL;
+    for (end = h->tail; end > start; end = rec)
+    {
+        rec = end - ring[(end - 1) % h->size];
+        n = ring[(rec + 4) % h->size];
+        pos = rec + UNDO_HEADER + (n < 0 ? 0 : UNDO_CURSOR*n + UNDO_STATS);
+        for (n = (int)(end - 1 - pos)/2 - 1; n >= 0; --n)
+        {
+            packed = ring[(pos + 2*n + 1) % h->size];
+            set(i, ring[(pos + 2*n) % h->size], packed >> 8, (char)packed);
+        }
+    }
+    i->history = h;
+
+    pos = start + UNDO_HEADER;
+    for (n = 0; n < num; ++n)
+    {
+        c = &i->cursors[n];
+        c->ir = ring[pos++ % h->size];
+        c->ic = ring[pos++ % h->size];
+        c->dr = ring[pos++ % h->size];
+        c->dc = ring[pos++ % h->size];
+        packed = ring[pos++ % h->size];
+        c->id = packed & 0xff;
+        c->dm = packed >> 8 & 0xff;
+        c->weight = packed >> 16 & 0xff;
+    }
+    stats = i->stats;
+    for (n = 0; n < UNDO_STATS; ++n)
+        memcpy((char *)&i->stats + n*sizeof(int), &ring[pos++ % h->size],
+               sizeof(int));
+    i->stats.timed_steps = stats.timed_steps;
+    i->stats.seconds = stats.seconds;
+    i->stats.reallocs = stats.reallocs;
+    i->stats.bytes_copied = stats.bytes_copied;
+    i->num_cursors = num;
+    i->readers = -1;
+    i->fld_sz.height = ring[(start + 1) % h->size];
+    h->tail = start;
+    i->steps -= count;
+
+    /* Run the steps after the snapshot again, logging them anew */
+    profile = i->profile;
+    i->profile = NULL;
+    for (n = count - 2; n >= 0; --n)
+        step(i, in[n], &out);
+    i->profile = profile;
+    return flags;
+}
+
+/* Starts or stops counting, for every cell, how often it is executed in
+   each direction and how often data pointers read and write it (see struct
+   CellCounts). Stopping discards the counts. While profiling,
+   interpreter_run() executes every step individually. Clones do not
+   inherit the counts. Returns 0 if the counts could not be allocated. */
+int interpreter_set_profiling(struct Interpreter *i, int enable)
+{
+    struct Profile *p = i->profile;
+
+    if (!enable || !p)
+    {
+        if (p)
+        {
+            free(p->cells);
+            free(p->rows);
+        }
+        free(p);
+        i->profile = NULL;
+    }
+    if (enable && !i->profile)
+    {
+        i->profile = calloc(1, sizeof(struct Profile));
+        if (!i->profile ||
+            !profile_resize(i->profile, i->fld_sz.height, i->fld_sz.width))
+        {
+            interpreter_set_profiling(i, 0);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Stores the execution counts of cell (row, col), or the totals of the row
+   with col = -1, in *counts. Cells that were never reached have no counts.
+   Returns 0 if the interpreter is not profiling. */
+int interpreter_get_counts(struct Interpreter *i, int row, int col,
+                           struct CellCounts *counts)
+{
+    struct Profile *p = i->profile;
+
+    if (!p)
+        return 0;
+    memset(counts, 0, sizeof(struct CellCounts));
+    if (row >= 0 && row < p->height && col < p->width)
+        *counts = col < 0 ? p->rows[row] : p->cells[row*p->width + col];
+    return 1;
+}
+
+/* Starts recording which cells the cursors execute, in a bitmap of `bits'
+   bits (a power of two, at least 8), or with bits = 0, stops. Cell (row,
+   col) sets bit interpreter_visit_bit(row, col, bits), so a clear bit shows
+   that a cell was not executed; a set bit may be shared with other cells.
+   While recording, interpreter_run() executes every step individually.
+   Clones do not inherit the bitmap. Returns 0 if it could not be
+   allocated. */
+int interpreter_set_visits(struct Interpreter *i, int bits)
+{
+    free(i->visits);
+    i->visits = NULL;
+    i->visit_bits = 0;
+    if (bits <= 0)
+        return 1;
+    i->visits = calloc(bits/8, 1);
+    if (!i->visits)
+        return 0;
+    i->visit_bits = bits;
+    return 1;
+}
+
+/* Adds the cells visited since the last call to `bitmap' (of the size
+   passed to interpreter_set_visits()), and starts over. */
+void interpreter_take_visits(struct Interpreter *i, unsigned char *bitmap)
+{
+    int n;
+
+    for (n = 0; n < i->visit_bits/8; ++n)
+        bitmap[n] |= i->visits[n];
+    memset(i->visits, 0, i->visit_bits/8);
+}
+
+/* Returns the bit for cell (row, col) in a visit bitmap of `bits' bits,
+   which must be a power of two. */
+int interpreter_visit_bit(int row, int col, int bits)
+{
+    unsigned h = (unsigned)row*0x9e3779b1u + (unsigned)col;
+
+    h ^= h >> 15;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return (int)(h & (unsigned)(bits - 1));
+}
+
+#ifndef NO_STDIO
+/* Writes the execution counts to a text file. After a header line
+   "refunge-profile 1", the lines are:
+
+       size <width> <height>
+       steps <steps executed>
+       row <row> <right> <down> <left> <up> <reads> <writes>
+       cell <row> <col> <right> <down> <left> <up> <reads> <writes>
+
+   with a line for every row and every cell that has non-zero counts; the
+   four directions are the IP visits. Returns 0 if the interpreter is not
+   profiling or the file could not be written. */
+int interpreter_save_profile(struct Interpreter *i, const char *filepath)
+{
+    struct Profile *p = i->profile;
+    struct CellCounts *k;
+    FILE *fp;
+    int r, c, ok;
+
+    if (!p)
+        return 0;
+    fp = fopen(filepath, "w");
+    if (!fp)
+        return 0;
+    fprintf(fp, "refunge-profile 1\nsize %d %d\nsteps %lld\n",
+            p->width, p->height, i->steps);
+    for (r = 0; r < p->height; ++r)
+    {
+        k = &p->rows[r];
+        if (k->visits[0] || k->visits[1] || k->visits[2] || k->visits[3] ||
+            k->reads || k->writes)
+            fprintf(fp, "row %d %lld %lld %lld %lld %lld %lld\n", r,
+                    k->visits[0], k->visits[1], k->visits[2], k->visits[3],
+                    k->reads, k->writes);
+    }
+    for (r = 0; r < p->height; ++r)
+        for (c = 0; c < p->width; ++c)
+        {
+            k = &p->cells[r*p->width + c];
+            if (k->visits[0] || k->visits[1] || k->visits[2] ||
+                k->visits[3] || k->reads || k->writes)
+                fprintf(fp, "cell %d %d %lld %lld %lld %lld %lld %lld\n",
+                        r, c, k->visits[0], k->visits[1], k->visits[2],
+                        k->visits[3], k->reads, k->writes);
+        }
+    ok = !ferror(fp);
+    return fclose(fp) == 0 && ok;
+}
+#endif /* ndef NO_STDIO */
+
+/* Stores the engine counters in *stats. */
+void interpreter_stats(struct Interpreter *i, struct Stats *stats)
+{
+    *stats = i->stats;
+    stats->steps = i->steps;
+    stats->cursors = i->num_cursors;
+    if (stats->peak_cursors < i->num_cursors)
+        stats->peak_cursors = i->num_cursors;
+    stats->steps_per_second = stats->seconds > 0
+                              ? stats->timed_steps/stats->seconds : 0;
 }
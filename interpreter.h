@@ -1,6 +1,8 @@
 #ifndef INTERPRETER_H_INCLUDED
 #define INTERPRETER_H_INCLUDED
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,7 +17,7 @@ enum Mode {
     M_NONE = 0, M_ADD, M_SUBTRACT, M_INPUT, M_OUTPUT, M_CLEAR
 };
 
-/* Data effects for cursors */
+/* Data effects of cursors, applied after all cursors have run */
 #define E_MASK          0x0f00
 #define E_ADD           0x0000
 #define E_INPUT         0x0100
@@ -31,37 +33,173 @@ enum Mode {
 /* Interpreter flags */
 #define F_NONE          0
 #define F_CLEAR_MODE    1
-#define F_ALL           1
+#define F_TILED         2    /* Store the field in 8x8 tiles */
+#define F_JOURNAL       4    /* Record changes to the field */
+#define F_NO_SKIP       8    /* Execute loops and no-op runs step by step */
+#define F_NO_SINGLE     16   /* Run single cursors like any number */
+#define F_NO_SIMD       32   /* Do not use the AVX2 kernel */
+#define F_NO_JIT        64   /* Do not compile hot single-cursor traces */
+#define F_NO_MERGE      128  /* Keep cursors in identical states apart */
+#define F_ALL           255
+
+/* The plain engine, against which the others are checked (see refcheck) */
+#define F_REFERENCE     (F_NO_SKIP | F_NO_SINGLE | F_NO_SIMD | F_NO_JIT | \
+                         F_NO_MERGE)
 
+/* Cursors are stored by value in a contiguous array, in execution order.
+   Cursors in identical states are merged into one, unless F_NO_MERGE is
+   set; its weight is the number of cursors it represents (modulo 256, so 0
+   stands for 256). */
 struct Cursor {
-    struct Cursor *next;
-    int ir, ic, id;
-    int dr, dc;
-    enum Mode dm;
-    int effect;
+    int ir, ic;                 /* instruction pointer */
+    int dr, dc;                 /* data pointer */
+    unsigned char id, dm;       /* direction (index into DR/DC) and enum Mode */
+    unsigned char weight;
+};
+
+/* Positions in the input and output streams, saved with a checkpoint.
+   out_offset is -1 when output does not go to a regular file; as such
+   output cannot be truncated on resuming, out_after then counts the bytes
+   written after the checkpoint, which a resumed run skips. */
+struct IOState {
+    long long in_offset, out_offset;
+    long long out_after;
+};
+
+/* Execution counts of a cell (or of all cells in a row) while profiling:
+   visits of instruction pointers moving in each direction, and accesses by
+   data pointers. Counts are per merged cursor: it counts as many times as
+   its weight, which is only known modulo 256. Counts for every cursor
+   need F_NO_MERGE. */
+struct CellCounts {
+    long long visits[4];
+    long long reads, writes;
+};
+
+/* Rules by which cursors are removed, indexing Stats.kills */
+#define K_DATA_TOP      0    /* Data pointer moved off the top */
+#define K_IP_TOP        1    /* Instruction pointer moved off the top */
+#define K_IP_BOTTOM     2    /* Instruction pointer moved off the bottom */
+#define NUM_KILLS       3
+
+/* Counters kept by the engine at all times, since the interpreter was
+   created or loaded. Counts are per merged cursor: cursors are counted as
+   stored, so a merged cursor counts once, and forks and kills of it count
+   once each. The cursor count changes by forks - kills - merges; with
+   F_NO_MERGE, every cursor is counted. */
+struct Stats {
+    long long steps;            /* steps executed, including skipped ones */
+    long long timed_steps;      /* steps executed by interpreter_run() */
+    double seconds;             /* time spent in interpreter_run() */
+    double steps_per_second;    /* timed_steps/seconds */
+    int cursors, peak_cursors;
+    long long forks, merges;
+    long long kills[NUM_KILLS];
+    long long reallocs;         /* field reallocations by growth */
+    long long bytes_copied;     /* bytes moved by these reallocations */
+    long long input, output;    /* bytes read and written */
+    long long blocked;          /* output steps dropped by conflicts */
+};
+
+/* Streaming I/O for interpreter_run_stream(). The caller sets the callbacks
+   and their argument, and zeroes the rest; the stream keeps input that was
+   read but not yet consumed, so it must be passed to every run of the same
+   program. read() stores up to `size' bytes and returns how many, 0 at end
+   of input, or -1 if no input is available yet. write() returns 0 if the
+   bytes could not be written. */
+#define STREAM_BUFFER   4096
+
+struct Stream {
+    int (*read)(void *arg, char *buf, int size);
+    int (*write)(void *arg, const char *buf, int size);
+    void *arg;
+    char buf[STREAM_BUFFER];
+    int pos, len, eof;
+};
+
+/* A data effect (E_ constant, with the value for E_ADD) on a cell */
+struct Effect {
+    int row, col, effect;
 };
 
 struct Interpreter
 {
-    char *field;
+    char **chunks;              /* field cells and instruction classes */
+    unsigned char **nops;       /* no-op run lengths per chunk, if built */
+    char *stale;                /* per chunk: run lengths are out of date */
+    int *insns;                 /* per chunk: number of instruction cells */
+    char *shared;               /* per chunk: may be shared with a clone */
+    int num_chunks, cap_chunks;
     struct Size fld_sz, fld_cap;
-    struct Cursor *cursors;
+    struct Cursor *cursors;     /* live cursors */
+    struct Cursor *spare;       /* cursors for the next step */
+    struct Effect *effects;     /* data effects of the current step */
+    int *slots;                 /* hash table used to merge cursors */
+    int *waiting;               /* cursors in input mode, by index */
+    int readers;                /* cursors whose next step reads input,
+                                   or -1 if they need to be counted */
+    int num_cursors, cap_cursors;
+    long long steps;            /* steps executed so far */
     int flags;
-    int output; /* temp */
+    long long op_changes;       /* class changes on compiled trace paths */
+    struct TraceCache *traces;  /* compiled traces, see run_trace() */
+    struct Pool *pool;          /* threads running cursors, if any */
+    struct LoopHint *loops;     /* loops not to be skipped for now */
+    struct Journal *journal;    /* changes to the field, with F_JOURNAL */
+    struct History *history;    /* undo log of the last steps, if kept */
+    struct Mapping *mapping;    /* checkpoint file holding shared chunks */
+    struct Profile *profile;    /* execution counts, while profiling */
+    unsigned char *visits;      /* cells visited, while recording visits */
+    int visit_bits;             /* size of visits, in bits */
+    struct Stats stats;         /* counters, see interpreter_stats() */
 };
 
+/* Reading and writing files; not in librefunge, which is built with
+   NO_STDIO. Use interpreter_from_memory() and interpreter_run_stream(). */
 struct Interpreter *interpreter_from_source(const char *filepath, char nul);
+struct Interpreter *interpreter_load(const char *filepath, struct IOState *io);
+int interpreter_save(struct Interpreter *i, const char *filepath,
+                     const struct IOState *io);
+int interpreter_save_io(const char *filepath, const struct IOState *io);
+int interpreter_save_profile(struct Interpreter *i, const char *filepath);
+
+struct Interpreter *interpreter_from_memory(const char *data, size_t size,
+                                            char nul);
 struct Interpreter *interpreter_create();
 struct Interpreter *interpreter_clone(struct Interpreter *i);
 void interpreter_destroy(struct Interpreter *i);
 char interpreter_get(struct Interpreter *i, int height, int width);
-void interpreter_put(struct Interpreter *i, int height, int width, char value);
+void interpreter_set(struct Interpreter *i, int height, int width, char value);
+void interpreter_add(struct Interpreter *i, int height, int width, int value);
 struct Size interpreter_size(struct Interpreter *i);
+void interpreter_resize(struct Interpreter *i, struct Size size);
 int interpreter_needs_input(struct Interpreter *i);
 int interpreter_step(struct Interpreter *i, int in, int *out);
+int interpreter_run(struct Interpreter *i, int max_steps,
+                    const char *in_buf, int in_len, char *out_buf, int out_cap,
+                    int *consumed, int *produced);
+int interpreter_run_stream(struct Interpreter *i, long long max_steps,
+                           struct Stream *s);
+int interpreter_num_cursors(struct Interpreter *i);
+int interpreter_get_cursor(struct Interpreter *i, int n, struct Cursor *c);
+int interpreter_set_cursor(struct Interpreter *i, int n,
+                           const struct Cursor *c);
+int interpreter_set_threads(struct Interpreter *i, int threads);
 int interpreter_get_flags(struct Interpreter *i);
 int interpreter_set_flags(struct Interpreter *i, int flags);
 int interpreter_add_flags(struct Interpreter *i, int flags);
+long long interpreter_changes_since(struct Interpreter *i, long long epoch,
+                                    void (*cb)(void *arg, int row, int col),
+                                    void *arg);
+int interpreter_set_history(struct Interpreter *i, int size);
+int interpreter_step_back(struct Interpreter *i);
+int interpreter_set_profiling(struct Interpreter *i, int enable);
+int interpreter_get_counts(struct Interpreter *i, int row, int col,
+                           struct CellCounts *counts);
+int interpreter_set_visits(struct Interpreter *i, int bits);
+void interpreter_take_visits(struct Interpreter *i, unsigned char *bitmap);
+int interpreter_visit_bit(int row, int col, int bits);
+void interpreter_stats(struct Interpreter *i, struct Stats *stats);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,93 @@
+#!/bin/bash
+# Compares the row-major and tiled (-T) field layouts on two 2048x8192
+# programs in which every step moves both the instruction pointer and the
+# data pointer, in add mode so that each move reads and writes a data cell.
+# The code fills the left half of the field and the data pointer walks the
+# right half. In vertical.ref, the instruction pointer runs down and up
+# columns of v's and ^'s; in horizontal.ref, it runs right and left along
+# rows of <'s and >'s, moving the data pointer down one row per row.
+#
+# The interpreter runs with skipping turned off (-N), so every cell is
+# executed, and the results are reported per step. Cache misses are counted
+# with perf stat when perf and the hardware cache counters are available;
+# they usually are not in virtual machines and containers, and then only
+# the time per step is reported, with a message saying that the counters
+# are missing.
+
+W=2048
+H=8192
+
+# Columns: down a column of v's and up one of ^'s, turning at the top and
+# bottom. The < at the top of each down column moves the data pointer one
+# column left; the first one wraps it around to the right edge.
+awk -v w=$W -v h=$H 'BEGIN {
+    code = w/2
+    for (r = 0; r < h; r++) {
+        line = r == 0 ? "+<" : "  "
+        for (c = 2; c + 1 < code; c += 2) {
+            if (r == 0)
+                line = line "\\" (c + 3 < code ? "/" : " ")
+            else if (r == h - 1)
+                line = line "\\/"
+            else if (r == 1)
+                line = line "<X"
+            else
+                line = line "v^"
+        }
+        printf "%-" w "s\n", line
+    }
+}' > vertical.ref
+
+# Rows: right along a row of <'s and left along one of >'s, turning at the
+# ends. The v at the start of each row moves the data pointer down a row.
+awk -v w=$W -v h=$H 'BEGIN {
+    code = w/2
+    left = right = ""
+    for (c = 3; c + 1 < code; c++) {
+        left = left "<"
+        right = right ">"
+    }
+    for (r = 0; r < h; r++) {
+        if (r % 2)
+            line = "/X" right "v/"
+        else
+            line = (r == 0 ? "+<" : "\\X") "v" left "\\"
+        printf "%-" w "s\n", line
+    }
+}' > horizontal.ref
+
+counters=
+if command -v perf >/dev/null &&
+    perf stat -x, -e cache-misses true 2>&1 >/dev/null | grep -q '^[0-9]'; then
+    counters=1
+else
+    echo "Cache miss counters are unavailable (no perf, or no hardware" \
+         "counters); reporting the time per step only."
+fi
+
+for prog in vertical.ref horizontal.ref; do
+    for flags in "" -T; do
+        if [ -n "$counters" ]; then
+            perf stat -x, -o layout.perf \
+                -e instructions,cache-references,cache-misses \
+                ./interpreter -S -N $flags $prog 2> layout.stats
+        else
+            ./interpreter -S -N $flags $prog 2> layout.stats
+        fi
+        awk -v prog=$prog -v layout="${flags:-row-major}" '
+            FILENAME ~ /stats$/ && $1 == "steps:" {
+                steps = $2
+                seconds = $(NF - 1)
+            }
+            FILENAME ~ /perf$/ && split($0, f, ",") > 2 &&
+                f[1] ~ /^[0-9]+$/ { count[f[3]] = f[1] }
+            END {
+                printf "%s %s: %d steps, %.2f ns/step", prog, layout,
+                       steps, 1e9*seconds/steps
+                for (e in count)
+                    printf ", %.3f %s/step", count[e]/steps, e
+                printf "\n"
+            }' layout.stats ${counters:+layout.perf}
+    done
+done
+rm -f vertical.ref horizontal.ref layout.stats layout.perf
@@ -1,22 +1,597 @@
 #include "interpreter.h"
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-
-#ifdef _MSC_VER     /* WIN32 */
 #include <getopt.h>
-#else               /* POSIX */
+
+#ifndef _MSC_VER    /* POSIX */
 #include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#if !defined(_MSC_VER) && !defined(NO_THREADS)
+#define USE_ASYNC_IO
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#endif
+
+/* Most steps run between checks for output to flush */
+#define RUN_STEPS   65536
+
+/* Checkpoints are written every checkpoint_every steps (if not 0) */
+static long long checkpoint_every;
+static const char *checkpoint_file;
+static long long checkpoint_steps;      /* steps at the last checkpoint */
+static long long input_offset;          /* input consumed by the program */
+
+/* Output that cannot be truncated on resuming (see struct IOState) is
+   counted in the checkpoint the run continues from as it is written, and
+   as much of the output of a resumed run is skipped. */
+static const char *saved_file;          /* checkpoint the run continues from */
+static struct IOState saved_io;         /* I/O state saved in it */
+static long long output_skip;           /* output left to skip */
+
+/* Returns the number of steps to run before the next checkpoint is due. */
+static int steps_to_run(struct Interpreter *i)
+{
+    long long left;
+
+    if (!checkpoint_every)
+        return RUN_STEPS;
+    left = checkpoint_every - i->steps%checkpoint_every;
+    return left < RUN_STEPS ? (int)left : RUN_STEPS;
+}
+
+/* Returns the position of stdout in the file it writes to, or -1 if it does
+   not write to a regular file. */
+static long long output_offset()
+{
+#ifdef _MSC_VER
+    return ftell(stdout);
+#else
+    struct stat st;
+
+    if (fstat(1, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    return lseek(1, 0, SEEK_CUR);
+#endif
+}
+
+static int checkpoint_due(struct Interpreter *i)
+{
+    return checkpoint_every && i->steps%checkpoint_every == 0 &&
+           i->steps != checkpoint_steps;
+}
+
+/* Writes a checkpoint. All output produced so far must have been written
+   to stdout. */
+static void checkpoint(struct Interpreter *i)
+{
+    struct IOState io;
+
+    checkpoint_steps = i->steps;
+    io.in_offset = input_offset;
+    io.out_offset = output_offset();
+    io.out_after = 0;
+    if (!interpreter_save(i, checkpoint_file, &io))
+    {
+        fprintf(stderr, "Could not write checkpoint %s\n", checkpoint_file);
+        return;
+    }
+    saved_file = checkpoint_file;
+    saved_io = io;
+}
+
+/* Counts `n' bytes of output written after the last checkpoint. */
+static void output_written(long long n)
+{
+    if (n == 0 || !saved_file || saved_io.out_offset >= 0)
+        return;
+    saved_io.out_after += n;
+    if (!interpreter_save_io(saved_file, &saved_io))
+        fprintf(stderr, "Could not update checkpoint %s\n", saved_file);
+}
+
+/* Drops the output an interrupted run wrote after its checkpoint from the
+   `n' bytes in buf. Returns the number of bytes left. */
+static int skip_output(char *buf, int n)
+{
+    int skip = output_skip < n ? (int)output_skip : n;
+
+    if (skip == 0)
+        return n;
+    output_skip -= skip;
+    memmove(buf, buf + skip, n - skip);
+    return n - skip;
+}
+
+/* Positions stdin and stdout where they were when a checkpoint was saved,
+   so a resumed run continues the output of the interrupted one. */
+static void resume_io(const char *filepath, const struct IOState *io)
+{
+    char buf[4096];
+    long long left;
+    int got;
+#ifndef _MSC_VER
+    struct stat st;
+#endif
+
+    saved_file = filepath;
+    saved_io = *io;
+    if (io->out_offset < 0)
+        output_skip = io->out_after;
+#ifndef _MSC_VER
+
+    if (io->out_offset >= 0 && fstat(1, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > io->out_offset)
+    {
+        if (ftruncate(1, io->out_offset) != 0)
+            fprintf(stderr, "Could not truncate output: %s\n",
+                    strerror(errno));
+        lseek(1, io->out_offset, SEEK_SET);
+    }
+    if (fstat(0, &st) == 0 && S_ISREG(st.st_mode) &&
+        lseek(0, io->in_offset, SEEK_CUR) >= 0)
+    {
+        input_offset = io->in_offset;
+        return;
+    }
+#endif
+
+    /* Skip the input that was consumed before the checkpoint */
+    for (left = io->in_offset; left > 0; left -= got)
+    {
+#ifdef _MSC_VER
+        got = (int)fread(buf, 1, left < (long long)sizeof(buf) ? (size_t)left
+                                                               : sizeof(buf),
+                         stdin);
+#else
+        got = read(0, buf, left < (long long)sizeof(buf) ? (size_t)left
+                                                         : sizeof(buf));
+        if (got < 0 && errno == EINTR)
+        {
+            got = 0;
+            continue;
+        }
+#endif
+        if (got <= 0)
+            break;
+    }
+    input_offset = io->in_offset - left;
+}
+
+/* Writes a summary of the engine counters to stderr. */
+static void print_stats(struct Interpreter *i)
+{
+    struct Stats s;
+
+    interpreter_stats(i, &s);
+    fprintf(stderr, "steps:          %lld (%.0f/s over %.3f s)\n",
+            s.steps, s.steps_per_second, s.seconds);
+    fprintf(stderr, "cursors:        %d (peak %d)\n",
+            s.cursors, s.peak_cursors);
+    fprintf(stderr, "forks:          %lld\n", s.forks);
+    fprintf(stderr, "merges:         %lld\n", s.merges);
+    fprintf(stderr, "kills:          %lld (data pointer off top %lld, "
+            "instruction pointer off top %lld, off bottom %lld)\n",
+            s.kills[K_DATA_TOP] + s.kills[K_IP_TOP] + s.kills[K_IP_BOTTOM],
+            s.kills[K_DATA_TOP], s.kills[K_IP_TOP], s.kills[K_IP_BOTTOM]);
+    fprintf(stderr, "reallocations:  %lld (%lld bytes copied)\n",
+            s.reallocs, s.bytes_copied);
+    fprintf(stderr, "input:          %lld bytes\n", s.input);
+    fprintf(stderr, "output:         %lld bytes (%lld blocked steps)\n",
+            s.output, s.blocked);
+}
+
+/* Runs the program with synchronous I/O. In interactive mode every output
+   byte is flushed as soon as it is produced. */
+static int run_sync(struct Interpreter *i, int interactive)
+{
+    char in_buf[1], out_buf[4096];
+    int status, in, in_len = 0, eof = 0, consumed, produced;
+
+    for (;;)
+    {
+        status = interpreter_run(i, steps_to_run(i), eof ? NULL : in_buf,
+                                 in_len, out_buf,
+                                 interactive ? 1 : sizeof(out_buf),
+                                 &consumed, &produced);
+        in_len -= consumed;
+        input_offset += consumed;
+        produced = skip_output(out_buf, produced);
+        fwrite(out_buf, 1, produced, stdout);
+        fflush(stdout);
+        output_written(produced);
+        if (status == I_EXIT || status == I_ERROR)
+            break;
+        if (checkpoint_due(i))
+            checkpoint(i);
+        if ((status & I_INPUT) && in_len == 0 && !eof)
+        {
+            in = fgetc(stdin);
+            if (in == EOF)
+                eof = 1;
+            else
+                in_buf[in_len++] = in;
+        }
+    }
+    return status;
+}
+
+#ifdef USE_ASYNC_IO
+/* Asynchronous I/O: a reader thread fills the input ring from stdin (unless
+   stdin is a regular file, which is mapped into memory instead) and a
+   writer thread drains the output ring to stdout, so the interpreter only
+   waits for I/O when it runs out of input or output space.
+
+   Each ring has a single producer and a single consumer, which only share
+   the free-running head and tail positions. The mutex and condition
+   variable are only used to sleep when a ring is empty or full: a thread
+   about to sleep publishes how many bytes (or how much space) it needs,
+   and the other side only signals when that need is met. */
+#define RING_SIZE   (1 << 16)
+
+struct Ring {
+    char *data;
+    unsigned head, tail;        /* positions written up to and read from */
+    unsigned need_data;         /* consumer sleeps until this much is used */
+    unsigned need_space;        /* producer sleeps until this much is free */
+    int closed;                 /* producer has finished */
+    int flush;                  /* consumer should pass data on right away */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+#define LOAD(x)         __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v)     __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+static int output_latency = 50;         /* milliseconds */
+
+static int ring_init(struct Ring *r)
+{
+    memset(r, 0, sizeof(struct Ring));
+    r->data = malloc(RING_SIZE);
+    if (!r->data)
+        return 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    return 1;
+}
+
+static void ring_destroy(struct Ring *r)
+{
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    free(r->data);
+}
+
+static unsigned ring_used(struct Ring *r)
+{
+    return LOAD(r->head) - LOAD(r->tail);
+}
+
+/* Returns the number of bytes that can be read contiguously at *p. */
+static unsigned ring_peek(struct Ring *r, char **p)
+{
+    unsigned tail = LOAD(r->tail), n = LOAD(r->head) - tail;
+
+    tail &= RING_SIZE - 1;
+    *p = r->data + tail;
+    return n < RING_SIZE - tail ? n : RING_SIZE - tail;
+}
+
+/* Returns the number of bytes that can be written contiguously at *p. */
+static unsigned ring_space(struct Ring *r, char **p)
+{
+    unsigned head = LOAD(r->head), n = RING_SIZE - (head - LOAD(r->tail));
+
+    head &= RING_SIZE - 1;
+    *p = r->data + head;
+    return n < RING_SIZE - head ? n : RING_SIZE - head;
+}
+
+static void ring_signal(struct Ring *r)
+{
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Publishes `n' bytes written at the position returned by ring_space(). */
+static void ring_commit(struct Ring *r, unsigned n)
+{
+    unsigned need;
+
+    if (n == 0)
+        return;
+    STORE(r->head, LOAD(r->head) + n);
+    need = LOAD(r->need_data);
+    if (need != 0 && ring_used(r) >= need)
+        ring_signal(r);
+}
+
+/* Releases `n' bytes read at the position returned by ring_peek(). */
+static void ring_consume(struct Ring *r, unsigned n)
+{
+    unsigned need;
+
+    if (n == 0)
+        return;
+    STORE(r->tail, LOAD(r->tail) + n);
+    need = LOAD(r->need_space);
+    if (need != 0 && RING_SIZE - ring_used(r) >= need)
+        ring_signal(r);
+}
+
+/* Marks the end of the data (by the producer). */
+static void ring_close(struct Ring *r)
+{
+    STORE(r->closed, 1);
+    ring_signal(r);
+}
+
+/* Asks the consumer to take all data written so far right away. */
+static void ring_flush(struct Ring *r)
+{
+    STORE(r->flush, 1);
+    if (LOAD(r->need_data) != 0)
+        ring_signal(r);
+}
+
+/* Waits until at least `want' bytes can be read, the ring is closed or
+   flushed, or the deadline (if any) has passed. */
+static void ring_wait_data(struct Ring *r, unsigned want,
+                           const struct timespec *deadline)
+{
+    pthread_mutex_lock(&r->lock);
+    STORE(r->need_data, want);
+    while (ring_used(r) < want && !LOAD(r->closed) && !LOAD(r->flush))
+    {
+        if (!deadline)
+            pthread_cond_wait(&r->wake, &r->lock);
+        else
+        if (pthread_cond_timedwait(&r->wake, &r->lock, deadline) == ETIMEDOUT)
+            break;
+    }
+    STORE(r->need_data, 0);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Waits until at least `want' bytes are free. */
+static void ring_wait_space(struct Ring *r, unsigned want)
+{
+    pthread_mutex_lock(&r->lock);
+    STORE(r->need_space, want);
+    while (RING_SIZE - ring_used(r) < want)
+        pthread_cond_wait(&r->wake, &r->lock);
+    STORE(r->need_space, 0);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *reader_main(void *arg)
+{
+    struct Ring *r = arg;
+    char *p;
+    unsigned n;
+    ssize_t got;
+
+    for (;;)
+    {
+        n = ring_space(r, &p);
+        if (n == 0)
+        {
+            ring_wait_space(r, 1);
+            continue;
+        }
+        got = read(0, p, n);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        ring_commit(r, got);
+    }
+    ring_close(r);
+    return NULL;
+}
+
+/* Writes output in large blocks: a block is written once half the ring is
+   used, when the interpreter flushes or closes the ring, or when output has
+   been waiting for output_latency milliseconds. */
+static void *writer_main(void *arg)
+{
+    struct Ring *r = arg;
+    struct timespec deadline;
+    char *p;
+    unsigned n;
+    ssize_t done;
+    int closed, flush, failed = 0;
+
+    for (;;)
+    {
+        closed = LOAD(r->closed);
+        flush = __atomic_exchange_n(&r->flush, 0, __ATOMIC_SEQ_CST);
+        if (ring_used(r) == 0)
+        {
+            if (closed)
+                break;
+            ring_wait_data(r, 1, NULL);
+            continue;
+        }
+        if (!closed && !flush && ring_used(r) < RING_SIZE/2)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += output_latency/1000;
+            deadline.tv_nsec += output_latency%1000*1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            ring_wait_data(r, RING_SIZE/2, &deadline);
+        }
+        while ((n = ring_peek(r, &p)) > 0)
+        {
+            /* After a write error, output is discarded */
+            for (done = 0; !failed && done < (ssize_t)n; )
+            {
+                ssize_t res = write(1, p + done, n - done);
+                if (res > 0)
+                    done += res;
+                else
+                if (res < 0 && errno != EINTR)
+                    failed = 1;
+            }
+            /* Counted before the ring is drained, so that a checkpoint
+               (which waits for that) is not saved while counting */
+            if (!failed)
+                output_written(n);
+            ring_consume(r, n);
+        }
+    }
+    return NULL;
+}
+
+/* Runs the program with asynchronous I/O. Returns -1 if the I/O threads
+   could not be set up, so synchronous I/O can be used instead. */
+static int run_async(struct Interpreter *i)
+{
+    static struct Ring in, out;
+    struct stat st;
+    pthread_t reader, writer;
+    const char *map = NULL;
+    char *in_buf, *out_buf;
+    size_t map_len = 0, map_pos = 0;
+    off_t offset;
+    unsigned in_len, out_cap;
+    int status, eof, consumed, produced;
+
+    if (!ring_init(&out))
+        return -1;
+    if (pthread_create(&writer, NULL, writer_main, &out) != 0)
+    {
+        ring_destroy(&out);
+        return -1;
+    }
+
+    /* Map stdin if it is a regular file, or start reading it */
+    if (fstat(0, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+        {
+            /* Start where stdin is positioned (after resuming) */
+            map_len = st.st_size;
+            offset = lseek(0, 0, SEEK_CUR);
+            map_pos = offset < 0 ? 0 : offset < st.st_size ? offset : map_len;
+            madvise((void *)map, map_len, MADV_SEQUENTIAL);
+        }
+    }
+    if (!map)
+    {
+        /* The reader may be blocked in read() when the program ends, so it
+           is never joined and its ring is never freed. */
+        if (!ring_init(&in) ||
+            pthread_create(&reader, NULL, reader_main, &in) != 0)
+        {
+            ring_close(&out);
+            pthread_join(writer, NULL);
+            ring_destroy(&out);
+            return -1;
+        }
+        pthread_detach(reader);
+    }
+
+    for (;;)
+    {
+        if (map)
+        {
+            in_buf = (char *)map + map_pos;
+            in_len = map_len - map_pos < RING_SIZE ? map_len - map_pos
+                                                   : RING_SIZE;
+            eof = in_len == 0;
+        }
+        else
+        {
+            eof = LOAD(in.closed);
+            in_len = ring_peek(&in, &in_buf);
+            eof = eof && in_len == 0;
+        }
+        out_cap = ring_space(&out, &out_buf);
+        if (out_cap == 0)
+        {
+            ring_wait_space(&out, 1);
+            continue;
+        }
+
+        status = interpreter_run(i, steps_to_run(i), eof ? NULL : in_buf,
+                                 in_len, out_buf, out_cap,
+                                 &consumed, &produced);
+        if (map)
+            map_pos += consumed;
+        else
+            ring_consume(&in, consumed);
+        input_offset += consumed;
+        ring_commit(&out, skip_output(out_buf, produced));
+        if (status == I_EXIT || status == I_ERROR)
+            break;
+
+        /* Let the writer drain the output ring before a checkpoint */
+        if (checkpoint_due(i))
+        {
+            ring_flush(&out);
+            ring_wait_space(&out, RING_SIZE);
+            checkpoint(i);
+        }
+
+        /* Wait for more input, making sure earlier output is shown first */
+        if ((status & I_INPUT) && (unsigned)consumed == in_len && !eof &&
+            !map)
+        {
+            ring_flush(&out);
+            ring_wait_data(&in, 1, NULL);
+        }
+    }
+
+    ring_close(&out);
+    pthread_join(writer, NULL);
+    ring_destroy(&out);
+    if (map)
+        munmap((void *)map, map_len);
+    return status;
+}
+#endif /* def USE_ASYNC_IO */
+
+#ifdef _MSC_VER
+/* Only the short forms of the long options are available */
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+    getopt(argc, argv, optstring)
+#else
+static const struct option long_options[] = {
+    { "checkpoint-every", required_argument, NULL, 'k' },
+    { "checkpoint-file", required_argument, NULL, 'f' },
+    { "resume", required_argument, NULL, 'r' },
+    { NULL, 0, NULL, 0 }
+};
 #endif
 
 int main(int argc, char *argv[])
 {
-    char nul = 0, clear_mode = 0, ch;
+    char nul = 0, clear_mode = 0, tiled = 0, interactive = 0, stats = 0;
+    char no_merge = 0, no_skip = 0;
+    const char *resume = NULL, *profile = NULL;
     struct Interpreter *i;
-    int status, in = 0, out;
+    struct IOState io;
+    FILE *fp;
+    int status, threads = 1, ch;
 
-    while ((ch = getopt(argc, argv, "*c:")) != -1)
+    while ((ch = getopt_long(argc, argv, "*c:f:ik:l:MNP:r:St:T", long_options,
+                             NULL)) != -1)
     {
         switch (ch)
         {
@@ -31,33 +606,134 @@ int main(int argc, char *argv[])
         case '*':
             clear_mode = 1;
             break;
+        case 'T':
+            tiled = 1;
+            break;
+        case 'M':
+            no_merge = 1;
+            break;
+        case 'N':
+            no_skip = 1;
+            break;
+        case 'i':
+            interactive = 1;
+            break;
+        case 'l':
+#ifdef USE_ASYNC_IO
+            output_latency = atoi(optarg);
+            if (output_latency < 0)
+            {
+                printf("-l expects a latency in milliseconds\n");
+                return 1;
+            }
+#endif
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads < 1)
+            {
+                printf("-t expects a positive number of threads\n");
+                return 1;
+            }
+            break;
+        case 'k':
+            checkpoint_every = atoll(optarg);
+            if (checkpoint_every < 1)
+            {
+                printf("--checkpoint-every expects a positive number of steps\n");
+                return 1;
+            }
+            break;
+        case 'f':
+            checkpoint_file = optarg;
+            break;
+        case 'r':
+            resume = optarg;
+            break;
+        case 'P':
+            profile = optarg;
+            break;
+        case 'S':
+            stats = 1;
+            break;
         }
     }
-    if (argc - optind != 1)
+    if (argc - optind != 1 && !(resume && argc == optind))
     {
-        printf("Usage: %s [-*] [-cx] <program>\n", argv[0]);
+        printf("Usage: %s [-*] [-S] [-T] [-M] [-N] [-i] [-cx] [-l ms]\n"
+               "       [-t threads] [-P profile]\n"
+               "       [--checkpoint-every|-k steps --checkpoint-file|-f file]\n"
+               "       [--resume|-r file] <program>\n", argv[0]);
         return argc != 1;
     }
+    if (checkpoint_every && !checkpoint_file)
+    {
+        printf("--checkpoint-every needs a --checkpoint-file\n");
+        return 1;
+    }
 
-    i = interpreter_from_source(argv[optind], nul);
-    if (!i)
+    /* Resume from the checkpoint if it exists, or else start the program */
+    if (resume && (fp = fopen(resume, "rb")) != NULL)
+    {
+        fclose(fp);
+        i = interpreter_load(resume, &io);
+        if (!i)
+        {
+            fprintf(stderr, "Invalid checkpoint %s\n", resume);
+            return 1;
+        }
+        resume_io(resume, &io);
+        checkpoint_steps = i->steps;
+    }
+    else
+    if (optind == argc)
     {
-        fprintf(stderr, "Could not open %s\n", argv[optind]);
+        fprintf(stderr, "Could not open %s\n", resume);
         return 1;
     }
+    else
+    {
+        i = interpreter_from_source(argv[optind], nul);
+        if (!i)
+        {
+            fprintf(stderr, "Could not open %s\n", argv[optind]);
+            return 1;
+        }
+    }
     if (clear_mode)
         interpreter_add_flags(i, F_CLEAR_MODE);
+    if (tiled)
+        interpreter_add_flags(i, F_TILED);
+    if (no_merge)
+        interpreter_add_flags(i, F_NO_MERGE);
+    if (no_skip)
+        interpreter_add_flags(i, F_NO_SKIP);
+    if (threads > 1)
+        interpreter_set_threads(i, threads);
+    if (profile && !interpreter_set_profiling(i, 1))
+    {
+        fprintf(stderr, "Could not allocate the profile\n");
+        return 1;
+    }
+
+    /* A fresh run is checkpointed before it starts, so that output it
+       writes to a pipe is counted from there */
+    if (checkpoint_every && !saved_file)
+        checkpoint(i);
 
-    status = I_SUCCESS;
-    while (status != I_EXIT && status != I_ERROR)
+    status = -1;
+#ifdef USE_ASYNC_IO
+    if (!interactive)
+        status = run_async(i);
+#endif
+    if (status == -1)
+        status = run_sync(i, interactive);
+    if (stats)
+        print_stats(i);
+    if (profile && !interpreter_save_profile(i, profile))
     {
-        in = (status & I_INPUT) ? fgetc(stdin) : -1;
-        status = interpreter_step(i, in, &out);
-        if (status & I_OUTPUT)
-        {
-            fputc(out, stdout);
-            fflush(stdout);
-        }
+        fprintf(stderr, "Could not write %s\n", profile);
+        return 1;
     }
     return status != I_EXIT;
 }
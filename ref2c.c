@@ -0,0 +1,378 @@
+#include "interpreter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _MSC_VER     /* WIN32 */
+#include <getopt.h>
+#else               /* POSIX */
+#include <unistd.h>
+#endif
+
+/* Ahead-of-time compiler from Refunge source to C.
+
+   While a program has a single cursor, its control flow only depends on
+   the instruction pointer, its direction and the data mode, as long as
+   the cells holding code are not modified. The compiler explores every
+   (row, column, direction, mode) state reachable from the initial state
+   in the loaded field and emits one label per state, with the instruction
+   at that cell executed inline and a goto to the successor state.
+
+   The generated program falls back to the regular interpreter (it must be
+   linked with interpreter.o) as soon as the static assumptions break:
+   when the cursor forks, when a data operation changes the instruction in
+   a cell that is executed as code, or when the instruction pointer leaves
+   the rows that were present in the source.
+
+   Usage: ref2c [-*] [-cx] prog.ref > prog.c
+          cc -O2 -o prog prog.c interpreter.o -lpthread */
+
+#define MODES 6
+
+static struct Interpreter *prog;
+static struct Size size;
+static int clear_mode;
+static unsigned char *reachable;    /* per state */
+static unsigned char *code;         /* per cell */
+
+static const char INSTRUCTIONS[] = "><v^X~+-?!*\\/|#@Y";
+
+/* Returns the instruction stored in a cell, or 0 for no-op cells. */
+static int instruction(int ch)
+{
+    return ch != 0 && strchr(INSTRUCTIONS, ch) ? ch : 0;
+}
+
+static int cell(int r, int c)
+{
+    return interpreter_get(prog, r, c);
+}
+
+static int state(int r, int c, int d, int m)
+{
+    return ((r*size.width + c)*4 + d)*MODES + m;
+}
+
+/* Computes the position `steps' cells away in direction d. */
+static void advance(int *r, int *c, int d, int steps)
+{
+    *r += steps*DR[d];
+    *c = ((*c + steps*DC[d])%size.width + size.width)%size.width;
+}
+
+/* Determines the direction and mode after executing cell (r,c) in
+   direction d and mode m, and how far the instruction pointer moves.
+   Returns 0 for instructions that are not compiled (forks). */
+static int transition(int r, int c, int *d, int *m, int *steps)
+{
+    *steps = 1;
+    switch (cell(r, c))
+    {
+    case '~': *m = M_NONE; break;
+    case '+': *m = M_ADD; break;
+    case '-': *m = M_SUBTRACT; break;
+    case '?': *m = M_INPUT; break;
+    case '!': *m = M_OUTPUT; break;
+    case '*':
+        if (clear_mode)
+            *m = M_CLEAR;
+        break;
+    case '\\': *d ^= 1; break;
+    case '/' : *d ^= 3; break;
+    case '|' : *d ^= 2; break;
+    case '#': *steps = 2; break;
+    case 'Y': return 0;
+    }
+    return 1;
+}
+
+/* Marks all states reachable from the initial state. */
+static void explore()
+{
+    int *queue, head, tail, n, s, r, c, d, m, steps, alt;
+
+    n = size.height*size.width*4*MODES;
+    reachable = calloc(n, 1);
+    code = calloc(size.height*size.width, 1);
+    queue = malloc(n*sizeof(int));
+    assert(reachable && code && queue);
+
+    head = tail = 0;
+    reachable[0] = 1;
+    queue[tail++] = 0;
+    while (head < tail)
+    {
+        s = queue[head++];
+        m = s%MODES;
+        d = s/MODES%4;
+        c = s/MODES/4%size.width;
+        r = s/MODES/4/size.width;
+        code[r*size.width + c] = 1 + instruction(cell(r, c));
+
+        /* A branch may also skip the next cell */
+        alt = cell(r, c) == '@';
+        if (!transition(r, c, &d, &m, &steps))
+            continue;
+        do {
+            int r2 = r, c2 = c;
+            advance(&r2, &c2, d, steps);
+            if (r2 >= 0 && r2 < size.height && !reachable[s = state(r2, c2, d, m)])
+            {
+                reachable[s] = 1;
+                queue[tail++] = s;
+            }
+            steps += 1;
+        } while (alt--);
+    }
+    free(queue);
+}
+
+/* Writes a jump to the state `steps' cells from (r,c) in direction d. */
+static void emit_goto(int r, int c, int d, int m, int steps)
+{
+    advance(&r, &c, d, steps);
+    if (r < 0)
+        printf("goto done;\n");
+    else
+    if (r < size.height)
+        printf("goto s%d;\n", state(r, c, d, m));
+    else
+        printf("return fallback(%d, %d, %d, dr, dc, %d);\n", r, c, d, m);
+}
+
+/* Writes the code for a data pointer move (and data operation). */
+static void emit_data(int r, int c, int d, int m)
+{
+    int r2 = r, c2 = c;
+
+    if (m == M_ADD || m == M_SUBTRACT || m == M_OUTPUT)
+        printf("    v = CELL(dr, dc);\n");
+    switch (cell(r, c))
+    {
+    case '>': printf("    if (++dc == W) dc = 0;\n"); break;
+    case 'v': printf("    if (++dr == height) grow();\n"); break;
+    case '<': printf("    if (dc-- == 0) dc = W - 1;\n"); break;
+    case '^': printf("    if (dr == 0) goto done;\n    --dr;\n"); break;
+    }
+    switch (m)
+    {
+    case M_NONE:
+        return;
+    case M_ADD:
+        printf("    CELL(dr, dc) += v;\n");
+        break;
+    case M_SUBTRACT:
+        printf("    CELL(dr, dc) -= v;\n");
+        break;
+    case M_INPUT:
+        printf("    fflush(stdout);\n");
+        printf("    if ((ch = getchar()) == EOF) ");
+        emit_goto(r, c, d, m, 1);
+        printf("    CELL(dr, dc) = ch;\n");
+        break;
+    case M_OUTPUT:
+        printf("    putchar(v);\n");
+        return;
+    case M_CLEAR:
+        printf("    CELL(dr, dc) = 0;\n");
+        break;
+    }
+
+    /* Leave compiled code if the write changed an instruction */
+    advance(&r2, &c2, d, 1);
+    printf("    if (CODE(dr, dc)) ");
+    if (r2 < 0)
+        printf("goto done;\n");
+    else
+        printf("return fallback(%d, %d, %d, dr, dc, %d);\n", r2, c2, d, m);
+}
+
+static void emit_state(int r, int c, int d, int m)
+{
+    int ch = cell(r, c), d2 = d, m2 = m, steps;
+
+    printf("s%d: /* (%d,%d) ", state(r, c, d, m), r, c);
+    if (ch > ' ' && ch < 127 && ch != '*' && ch != '/')
+        printf("'%c'", ch);
+    else
+        printf("%d", ch&0xff);
+    printf(" dir %d mode %d */\n", d, m);
+
+    switch (ch)
+    {
+    case '>': case 'v': case '<': case '^': case 'X':
+        emit_data(r, c, d, m);
+        break;
+    case '@':
+        printf("    if (CELL(dr, dc) == 0) ");
+        emit_goto(r, c, d, m, 2);
+        break;
+    case 'Y':
+        printf("    return fallback(%d, %d, %d, dr, dc, %d);\n", r, c, d, m);
+        return;
+    }
+    transition(r, c, &d2, &m2, &steps);
+    printf("    ");
+    emit_goto(r, c, d2, m2, steps);
+}
+
+static void emit_program(const char *filepath)
+{
+    int r, c, s, n;
+
+    printf("/* Generated by ref2c from %s */\n", filepath);
+    printf("#include \"interpreter.h\"\n");
+    printf("#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n");
+    printf("#define W %d\n#define H %d\n", size.width, size.height);
+    printf("#define CLEAR_MODE %d\n", clear_mode);
+    printf("#define CELL(r, c) field[(r)*W + (c)]\n");
+    printf("#define CODE(r, c) ((r) < H && code[(r)*W + (c)] && \\\n"
+           "    insn[CELL(r, c)&0xff] != code[(r)*W + (c)] - 1)\n\n");
+
+    printf("/* Instruction in each byte value, or 0 for no-ops */\n");
+    printf("static const unsigned char insn[256] = {");
+    for (n = 0; n < 256; ++n)
+        printf("%s%d,", n%16 ? " " : "\n    ", instruction(n));
+    printf("\n};\n\n");
+
+    printf("static const char initial[H*W] = {");
+    for (n = 0; n < size.height*size.width; ++n)
+        printf("%s%d,", n%20 ? " " : "\n    ",
+               cell(n/size.width, n%size.width));
+    printf("\n};\n\n");
+
+    printf("/* For cells executed as code: 1 + the compiled instruction */\n");
+    printf("static const unsigned char code[H*W] = {");
+    for (n = 0; n < size.height*size.width; ++n)
+        printf("%s%d,", n%20 ? " " : "\n    ", code[n]);
+    printf("\n};\n\n");
+
+    printf("%s",
+"static char *field;\n"
+"static int height, capacity;\n"
+"\n"
+"static void grow()\n"
+"{\n"
+"    if (++height > capacity)\n"
+"    {\n"
+"        field = realloc(field, 2*capacity*W);\n"
+"        if (!field)\n"
+"            abort();\n"
+"        memset(field + capacity*W, 0, capacity*W);\n"
+"        capacity *= 2;\n"
+"    }\n"
+"}\n"
+"\n"
+"/* Continues execution in the interpreter */\n"
+"static int fallback(int ir, int ic, int id, int dr, int dc, int dm)\n"
+"{\n"
+"    struct Interpreter *i;\n"
+"    struct Cursor cursor;\n"
+"    struct Size sz;\n"
+"    int r, c, status, in, out;\n"
+"\n"
+"    if (ir < 0 || ir >= height)\n"
+"        return 0;\n"
+"    i = interpreter_create();\n"
+"    if (!i)\n"
+"        return 1;\n"
+"    sz.width = W;\n"
+"    sz.height = height;\n"
+"    interpreter_resize(i, sz);\n"
+"    for (r = 0; r < height; ++r)\n"
+"        for (c = 0; c < W; ++c)\n"
+"            interpreter_set(i, r, c, CELL(r, c));\n"
+"    if (CLEAR_MODE)\n"
+"        interpreter_add_flags(i, F_CLEAR_MODE);\n"
+"    interpreter_get_cursor(i, 0, &cursor);\n"
+"    cursor.ir = ir;\n"
+"    cursor.ic = ic;\n"
+"    cursor.id = id;\n"
+"    cursor.dr = dr;\n"
+"    cursor.dc = dc;\n"
+"    cursor.dm = dm;\n"
+"    interpreter_set_cursor(i, 0, &cursor);\n"
+"\n"
+"    status = interpreter_needs_input(i) ? I_INPUT : I_SUCCESS;\n"
+"    while (status != I_EXIT && status != I_ERROR)\n"
+"    {\n"
+"        in = (status & I_INPUT) ? fgetc(stdin) : -1;\n"
+"        status = interpreter_step(i, in, &out);\n"
+"        if (status & I_OUTPUT)\n"
+"        {\n"
+"            fputc(out, stdout);\n"
+"            fflush(stdout);\n"
+"        }\n"
+"    }\n"
+"    interpreter_destroy(i);\n"
+"    return status != I_EXIT;\n"
+"}\n"
+"\n"
+"int main()\n"
+"{\n"
+"    int dr = 0, dc = 0, ch;\n"
+"    char v;\n"
+"\n"
+"    capacity = height = H;\n"
+"    field = malloc(H*W);\n"
+"    if (!field)\n"
+"        return 1;\n"
+"    memcpy(field, initial, H*W);\n"
+"    (void)ch;\n"
+"    (void)v;\n"
+"\n");
+
+    for (r = 0; r < size.height; ++r)
+        for (c = 0; c < size.width; ++c)
+            for (s = 0; s < 4*MODES; ++s)
+                if (reachable[state(r, c, s/MODES, s%MODES)])
+                    emit_state(r, c, s/MODES, s%MODES);
+
+    printf("%s",
+"done:\n"
+"    fflush(stdout);\n"
+"    return 0;\n"
+"}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char nul = 0;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "*c:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c':
+            if (strlen(optarg) != 1)
+            {
+                printf("-c expects a single character, not \"%s\"\n", optarg);
+                return 1;
+            }
+            nul = *optarg;
+            break;
+        case '*':
+            clear_mode = 1;
+            break;
+        }
+    }
+    if (argc - optind != 1)
+    {
+        printf("Usage: %s [-*] [-cx] <program>\n", argv[0]);
+        return argc != 1;
+    }
+
+    prog = interpreter_from_source(argv[optind], nul);
+    if (!prog)
+    {
+        fprintf(stderr, "Could not open %s\n", argv[optind]);
+        return 1;
+    }
+    size = interpreter_size(prog);
+
+    explore();
+    emit_program(argv[optind]);
+    return 0;
+}
@@ -0,0 +1,378 @@
+#include "interpreter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Batch runner. Runs the jobs listed in a manifest, each a program with an
+   input file, on a pool of threads within one process. Every distinct
+   program is loaded once; each job runs on a clone of it, which shares the
+   field with the loaded program until it writes to it. Manifest lines are:
+
+     program  input  output
+
+   where input may be - for none (the input is then at end of file from
+   the start). Blank lines and lines starting with # are skipped. The
+   output of a job is written to `output', and its status to
+   `output.status', as a single line:
+
+     exit <code> steps <n> input <bytes> output <bytes> seconds <t>
+
+   with code 0 if the program ended, 1 if it ran into the step limit (-n),
+   and 2 if it failed (its files could not be read or written). A summary
+   with the aggregate throughput is written to stderr; the exit status is 1
+   if any job failed.
+
+   Threads take the next job from a shared counter as they finish one, so
+   that a long job only holds up its own thread. Jobs are started in order
+   of decreasing input size, which keeps the longest ones from being left
+   to the end when job lengths follow the input.
+
+   Usage: refbatch [-*T] [-cx] [-t threads] [-n steps] manifest */
+
+#define RUN_STEPS   65536
+#define OUT_SIZE    65536
+
+struct Job {
+    const char *program, *input, *output;
+    int prog;                   /* index into programs */
+    long long in_size;
+    long long steps, in_bytes, out_bytes;
+    double seconds;
+    int code;
+};
+
+static struct Job *jobs;
+static int num_jobs;
+static struct Job **order;      /* jobs in the order they are started */
+static int next_job;            /* index into order, taken atomically */
+
+static struct Interpreter **programs;
+static pthread_mutex_t clone_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long max_steps;     /* per job, or 0 for no limit */
+
+static double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Reads a whole file into memory. Returns NULL on failure. */
+static char *read_file(const char *filepath, long long *size)
+{
+    struct stat st;
+    FILE *fp;
+    char *buf;
+
+    fp = fopen(filepath, "rb");
+    if (!fp)
+        return NULL;
+    buf = NULL;
+    if (fstat(fileno(fp), &st) == 0 && (buf = malloc(st.st_size + 1)) &&
+        fread(buf, 1, st.st_size, fp) != (size_t)st.st_size)
+    {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    *size = buf ? st.st_size : 0;
+    return buf;
+}
+
+/* Runs a job to completion on the calling thread. */
+static void run_job(struct Job *job)
+{
+    struct Interpreter *i;
+    char *in_buf = NULL, out_buf[OUT_SIZE], path[4096];
+    long long in_len = 0, in_pos = 0;
+    int status, steps, consumed, produced;
+    double start = now();
+    FILE *out, *fp;
+
+    job->code = 2;
+    pthread_mutex_lock(&clone_lock);
+    i = interpreter_clone(programs[job->prog]);
+    pthread_mutex_unlock(&clone_lock);
+    out = fopen(job->output, "wb");
+    if (strcmp(job->input, "-") != 0)
+        in_buf = read_file(job->input, &in_len);
+    if (!i || !out || (!in_buf && strcmp(job->input, "-") != 0))
+        goto done;
+
+    for (;;)
+    {
+        steps = RUN_STEPS;
+        if (max_steps && max_steps - i->steps < steps)
+            steps = (int)(max_steps - i->steps);
+        if (steps == 0)
+        {
+            job->code = 1;
+            break;
+        }
+        status = interpreter_run(i, steps,
+                                 in_pos < in_len ? in_buf + in_pos : NULL,
+                                 (int)(in_len - in_pos < 1 << 30
+                                       ? in_len - in_pos : 1 << 30),
+                                 out_buf, sizeof(out_buf),
+                                 &consumed, &produced);
+        in_pos += consumed;
+        if (fwrite(out_buf, 1, produced, out) != (size_t)produced ||
+            status == I_ERROR)
+            break;
+        job->out_bytes += produced;
+        if (status == I_EXIT)
+        {
+            job->code = 0;
+            break;
+        }
+    }
+    job->steps = i->steps;
+    job->in_bytes = in_pos;
+
+done:
+    if (out && fclose(out) != 0)
+        job->code = 2;
+    free(in_buf);
+    interpreter_destroy(i);
+    job->seconds = now() - start;
+
+    sprintf(path, "%.4080s.status", job->output);
+    fp = fopen(path, "w");
+    if (!fp)
+    {
+        job->code = 2;
+        return;
+    }
+    fprintf(fp, "exit %d steps %lld input %lld output %lld seconds %.6f\n",
+            job->code, job->steps, job->in_bytes, job->out_bytes,
+            job->seconds);
+    if (fclose(fp) != 0)
+        job->code = 2;
+}
+
+static void *worker(void *arg)
+{
+    int n;
+
+    (void)arg;
+    while ((n = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < num_jobs)
+        run_job(order[n]);
+    return NULL;
+}
+
+static int by_program(const void *a, const void *b)
+{
+    return strcmp((*(struct Job **)a)->program, (*(struct Job **)b)->program);
+}
+
+static int by_input_size(const void *a, const void *b)
+{
+    const struct Job *p = *(struct Job **)a, *q = *(struct Job **)b;
+
+    if (p->in_size != q->in_size)
+        return p->in_size > q->in_size ? -1 : 1;
+    return (int)(p - q);
+}
+
+/* Reads the manifest into jobs. Returns 0 on failure. */
+static int read_manifest(const char *filepath)
+{
+    char line[3*4096 + 16], a[4096], b[4096], c[4096], extra[2];
+    struct stat st;
+    FILE *fp;
+    int cap = 0, lineno = 0;
+    struct Job *job;
+
+    fp = fopen(filepath, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Could not open %s\n", filepath);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        lineno += 1;
+        switch (sscanf(line, "%4095s %4095s %4095s %1s", a, b, c, extra))
+        {
+        case EOF:
+            continue;
+        case 3:
+            break;
+        default:
+            if (a[0] == '#')
+                continue;
+            fprintf(stderr, "%s:%d: expected program, input and output\n",
+                    filepath, lineno);
+            fclose(fp);
+            return 0;
+        }
+        if (a[0] == '#')
+            continue;
+        if (num_jobs == cap)
+        {
+            cap = cap ? 2*cap : 256;
+            jobs = realloc(jobs, cap*sizeof(struct Job));
+            if (!jobs)
+            {
+                fclose(fp);
+                return 0;
+            }
+        }
+        job = &jobs[num_jobs++];
+        memset(job, 0, sizeof(struct Job));
+        job->program = strdup(a);
+        job->input = strdup(b);
+        job->output = strdup(c);
+        if (!job->program || !job->input || !job->output)
+        {
+            fclose(fp);
+            return 0;
+        }
+        if (strcmp(b, "-") != 0 && stat(b, &st) == 0)
+            job->in_size = st.st_size;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Loads every distinct program once. Returns 0 on failure. */
+static int load_programs(char nul, int flags)
+{
+    struct Job *job, *prev = NULL;
+    int n, num_programs = 0;
+
+    programs = malloc(num_jobs*sizeof(struct Interpreter *));
+    if (!programs)
+        return 0;
+    qsort(order, num_jobs, sizeof(struct Job *), by_program);
+    for (n = 0; n < num_jobs; ++n)
+    {
+        job = order[n];
+        if (!prev || strcmp(job->program, prev->program) != 0)
+        {
+            programs[num_programs] = interpreter_from_source(job->program,
+                                                             nul);
+            if (!programs[num_programs])
+            {
+                fprintf(stderr, "Could not open %s\n", job->program);
+                return 0;
+            }
+            interpreter_add_flags(programs[num_programs++], flags);
+        }
+        job->prog = num_programs - 1;
+        prev = job;
+    }
+    fprintf(stderr, "%d jobs, %d programs\n", num_jobs, num_programs);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *threads;
+    long long steps = 0, in_bytes = 0, out_bytes = 0;
+    double start, seconds;
+    int ch, n, num_threads, failed = 0, limited = 0, flags = F_NONE;
+    char nul = 0;
+
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    while ((ch = getopt(argc, argv, "*c:n:t:T")) != -1)
+    {
+        switch (ch)
+        {
+        case '*':
+            flags |= F_CLEAR_MODE;
+            break;
+        case 'c':
+            if (strlen(optarg) != 1)
+            {
+                printf("-c expects a single character, not \"%s\"\n", optarg);
+                return 1;
+            }
+            nul = *optarg;
+            break;
+        case 'n':
+            max_steps = atoll(optarg);
+            if (max_steps < 1)
+            {
+                printf("-n expects a positive number of steps\n");
+                return 1;
+            }
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            if (num_threads < 1)
+            {
+                printf("-t expects a positive number of threads\n");
+                return 1;
+            }
+            break;
+        case 'T':
+            flags |= F_TILED;
+            break;
+        }
+    }
+    if (argc - optind != 1)
+    {
+        printf("Usage: %s [-*T] [-cx] [-t threads] [-n steps] <manifest>\n",
+               argv[0]);
+        return argc != 1;
+    }
+    if (num_threads < 1)
+        num_threads = 1;
+
+    if (!read_manifest(argv[optind]))
+        return 1;
+    order = malloc((num_jobs + 1)*sizeof(struct Job *));
+    threads = malloc(num_threads*sizeof(pthread_t));
+    if (!order || !threads)
+        return 1;
+    for (n = 0; n < num_jobs; ++n)
+        order[n] = &jobs[n];
+    if (!load_programs(nul, flags))
+        return 1;
+    qsort(order, num_jobs, sizeof(struct Job *), by_input_size);
+
+    start = now();
+    if (num_threads > num_jobs)
+        num_threads = num_jobs > 0 ? num_jobs : 1;
+    for (n = 0; n < num_threads; ++n)
+        if (pthread_create(&threads[n], NULL, worker, NULL) != 0)
+            break;
+    if (n == 0)
+        worker(NULL);
+    while (n-- > 0)
+        pthread_join(threads[n], NULL);
+    seconds = now() - start;
+
+    for (n = 0; n < num_jobs; ++n)
+    {
+        steps += jobs[n].steps;
+        in_bytes += jobs[n].in_bytes;
+        out_bytes += jobs[n].out_bytes;
+        if (jobs[n].code == 1)
+            limited += 1;
+        if (jobs[n].code == 2)
+        {
+            failed += 1;
+            fprintf(stderr, "%s < %s > %s: failed\n", jobs[n].program,
+                    jobs[n].input, jobs[n].output);
+        }
+    }
+    fprintf(stderr, "jobs:      %d (%d failed, %d at the step limit)\n",
+            num_jobs, failed, limited);
+    fprintf(stderr, "steps:     %lld\n", steps);
+    fprintf(stderr, "input:     %lld bytes\n", in_bytes);
+    fprintf(stderr, "output:    %lld bytes\n", out_bytes);
+    fprintf(stderr, "seconds:   %.3f on %d threads\n", seconds, num_threads);
+    if (seconds > 0)
+        fprintf(stderr, "rate:      %.1f jobs/s, %.0f steps/s, %.0f bytes/s\n",
+                num_jobs/seconds, steps/seconds,
+                (in_bytes + out_bytes)/seconds);
+    return failed > 0;
+}
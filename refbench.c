@@ -0,0 +1,373 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/* Benchmark harness. Runs the workloads listed in a file (bench/workloads)
+   through the interpreter a number of times and writes the results as JSON
+   to stdout, one workload per line:
+
+     steps            steps executed, as reported by interpreter -S
+     input_bytes      bytes read by the program
+     output_bytes     bytes written by the program
+     seconds_min      fastest wall-clock time of a run
+     seconds_mean     mean wall-clock time
+     seconds_stddev   standard deviation of the wall-clock time
+     steps_per_sec    steps/seconds_mean
+     bytes_per_sec    (input_bytes + output_bytes)/seconds_mean
+     peak_rss_kb      largest resident set size of a run
+
+   With -b, the results are compared against a file written by an earlier
+   run: a table with the change in steps per second is written to stderr,
+   and the exit status is 2 if any workload got slower by more than the
+   threshold (in percent, -x), or executed a different number of steps.
+
+   Usage: refbench [-i interpreter] [-n runs] [-b baseline.json]
+                   [-x percent] workloads */
+
+#define MAX_ARGS    32
+#define MAX_RUNS    100
+
+struct Result {
+    char name[64];
+    long long steps, input, output;
+    double min, mean, stddev;
+    double steps_per_sec, bytes_per_sec;
+    long peak_rss;
+};
+
+static const char *interpreter = "./interpreter";
+static int runs = 5;
+
+static double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Appends `count' copies of a file to fp. */
+static int append(FILE *fp, const char *filepath, int count)
+{
+    char buf[4096];
+    FILE *in;
+    size_t got;
+    int ok = 1;
+
+    in = fopen(filepath, "rb");
+    if (!in)
+        return 0;
+    while (count-- > 0 && ok)
+    {
+        rewind(in);
+        while ((got = fread(buf, 1, sizeof(buf), in)) > 0)
+            if (fwrite(buf, 1, got, fp) != got)
+                ok = 0;
+        if (ferror(in))
+            ok = 0;
+    }
+    fclose(in);
+    return ok;
+}
+
+/* Reads the counter after `label' from the -S summary of the interpreter. */
+static long long counter(FILE *fp, const char *label)
+{
+    char line[256];
+    long long value = -1;
+
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, label, strlen(label)) == 0)
+            value = atoll(line + strlen(label));
+    return value;
+}
+
+/* Runs the interpreter once with the given arguments, standard input read
+   from `in', and the summary written to `summary'. Returns the wall-clock
+   time in seconds, or -1 if the interpreter failed. */
+static double run_once(char **args, FILE *in, FILE *summary, long *rss)
+{
+    struct rusage usage;
+    double start;
+    pid_t pid;
+    int status, null;
+
+    fflush(stdout);
+    fflush(stderr);
+    rewind(in);
+    rewind(summary);
+    if (ftruncate(fileno(summary), 0) != 0)
+        return -1;
+    start = now();
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        null = open("/dev/null", O_WRONLY);
+        dup2(fileno(in), 0);
+        dup2(null, 1);
+        dup2(fileno(summary), 2);
+        execv(args[0], args);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) != pid)
+        return -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    *rss = usage.ru_maxrss;
+    return now() - start;
+}
+
+/* Runs a workload line of the form: name flags program input... */
+static int run_workload(char *line, struct Result *r)
+{
+    char *words[MAX_ARGS], *args[MAX_ARGS + 3], *flag, *star;
+    double times[MAX_RUNS], sum = 0, sq = 0;
+    FILE *in, *summary;
+    long rss;
+    int n, k, num_words = 0, num_args = 0;
+
+    for (flag = strtok(line, " \t\r\n"); flag && num_words < MAX_ARGS;
+         flag = strtok(NULL, " \t\r\n"))
+        words[num_words++] = flag;
+    if (num_words < 3)
+    {
+        fprintf(stderr, "Invalid workload: %s\n", line);
+        return 0;
+    }
+    memset(r, 0, sizeof(*r));
+    strncpy(r->name, words[0], sizeof(r->name) - 1);
+
+    /* Arguments: interpreter -S flags program */
+    args[num_args++] = (char *)interpreter;
+    args[num_args++] = "-S";
+    if (strcmp(words[1], "-") != 0)
+        for (flag = strtok(words[1], ","); flag && num_args < MAX_ARGS;
+             flag = strtok(NULL, ","))
+            args[num_args++] = flag;
+    args[num_args++] = words[2];
+    args[num_args] = NULL;
+
+    /* Standard input */
+    in = tmpfile();
+    summary = tmpfile();
+    if (!in || !summary)
+    {
+        fprintf(stderr, "Could not create temporary files\n");
+        return 0;
+    }
+    for (n = 3; n < num_words; ++n)
+    {
+        k = 1;
+        star = strchr(words[n], '*');
+        if (star)
+        {
+            *star = '\0';
+            k = atoi(star + 1);
+        }
+        if (!append(in, words[n], k))
+        {
+            fprintf(stderr, "Could not read %s\n", words[n]);
+            return 0;
+        }
+    }
+    fflush(in);
+
+    for (n = 0; n < runs; ++n)
+    {
+        times[n] = run_once(args, in, summary, &rss);
+        if (times[n] < 0)
+        {
+            fprintf(stderr, "%s: the interpreter failed\n", r->name);
+            return 0;
+        }
+        if (rss > r->peak_rss)
+            r->peak_rss = rss;
+        sum += times[n];
+        if (n == 0 || times[n] < r->min)
+            r->min = times[n];
+    }
+    r->steps = counter(summary, "steps:");
+    r->input = counter(summary, "input:");
+    r->output = counter(summary, "output:");
+    fclose(in);
+    fclose(summary);
+
+    r->mean = sum/runs;
+    for (n = 0; n < runs; ++n)
+        sq += (times[n] - r->mean)*(times[n] - r->mean);
+    r->stddev = runs > 1 ? sqrt(sq/(runs - 1)) : 0;
+    r->steps_per_sec = r->steps/r->mean;
+    r->bytes_per_sec = (r->input + r->output)/r->mean;
+    return 1;
+}
+
+static void print_result(const struct Result *r, int last)
+{
+    printf("  {\"name\": \"%s\", \"steps\": %lld, \"input_bytes\": %lld, "
+           "\"output_bytes\": %lld, \"seconds_min\": %.6f, "
+           "\"seconds_mean\": %.6f, \"seconds_stddev\": %.6f, "
+           "\"steps_per_sec\": %.0f, \"bytes_per_sec\": %.0f, "
+           "\"peak_rss_kb\": %ld}%s\n",
+           r->name, r->steps, r->input, r->output, r->min, r->mean,
+           r->stddev, r->steps_per_sec, r->bytes_per_sec, r->peak_rss,
+           last ? "" : ",");
+}
+
+/* Finds the result for a workload in a file written by print_result(). */
+static int find_baseline(FILE *fp, const char *name, struct Result *r)
+{
+    char line[1024], key[80];
+    const char *p;
+
+    sprintf(key, "{\"name\": \"%s\",", name);
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp))
+    {
+        p = strstr(line, key);
+        if (!p)
+            continue;
+        p = strstr(line, "\"steps\": ");
+        if (!p || sscanf(p, "\"steps\": %lld", &r->steps) != 1)
+            return 0;
+        p = strstr(line, "\"steps_per_sec\": ");
+        return p && sscanf(p, "\"steps_per_sec\": %lf",
+                           &r->steps_per_sec) == 1;
+    }
+    return 0;
+}
+
+/* Writes a comparison with the baseline to stderr. Returns the number of
+   workloads that regressed. */
+static int compare(const char *filepath, const struct Result *results,
+                   int count, double threshold)
+{
+    const struct Result *r;
+    struct Result base;
+    FILE *fp;
+    double change;
+    int n, regressions = 0;
+
+    fp = fopen(filepath, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Could not open %s\n", filepath);
+        return -1;
+    }
+    fprintf(stderr, "%-16s %14s %14s %8s\n", "workload", "baseline/s",
+            "current/s", "change");
+    for (n = 0; n < count; ++n)
+    {
+        r = &results[n];
+        if (!find_baseline(fp, r->name, &base))
+        {
+            fprintf(stderr, "%-16s %14s %14.0f\n", r->name, "-",
+                    r->steps_per_sec);
+            continue;
+        }
+        change = 100*(r->steps_per_sec/base.steps_per_sec - 1);
+        fprintf(stderr, "%-16s %14.0f %14.0f %+7.1f%%", r->name,
+                base.steps_per_sec, r->steps_per_sec, change);
+        if (base.steps != r->steps)
+        {
+            fprintf(stderr, "  steps differ (%lld)", base.steps);
+            regressions += 1;
+        }
+        else
+        if (change < -threshold)
+        {
+            fprintf(stderr, "  slower");
+            regressions += 1;
+        }
+        fprintf(stderr, "\n");
+    }
+    fclose(fp);
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    struct Result *results = NULL;
+    const char *baseline = NULL;
+    char line[1024], *p;
+    double threshold = 10;
+    FILE *fp;
+    int ch, count = 0, cap = 0;
+
+    while ((ch = getopt(argc, argv, "b:i:n:x:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'i':
+            interpreter = optarg;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS)
+            {
+                printf("-n expects a number of runs from 1 to %d\n", MAX_RUNS);
+                return 1;
+            }
+            break;
+        case 'x':
+            threshold = atof(optarg);
+            break;
+        }
+    }
+    if (argc - optind != 1)
+    {
+        printf("Usage: %s [-i interpreter] [-n runs] [-b baseline.json] "
+               "[-x percent] <workloads>\n", argv[0]);
+        return argc != 1;
+    }
+
+    fp = fopen(argv[optind], "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Could not open %s\n", argv[optind]);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp))
+    {
+        for (p = line; *p == ' ' || *p == '\t'; ++p) { }
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (count == cap)
+        {
+            cap = cap ? 2*cap : 16;
+            results = realloc(results, cap*sizeof(struct Result));
+            if (!results)
+                return 1;
+        }
+        fprintf(stderr, "%s", p);
+        if (!run_workload(p, &results[count]))
+            return 1;
+        count += 1;
+    }
+    fclose(fp);
+
+    printf("{\"runs\": %d, \"workloads\": [\n", runs);
+    for (ch = 0; ch < count; ++ch)
+        print_result(&results[ch], ch == count - 1);
+    printf("]}\n");
+
+    if (baseline)
+    {
+        ch = compare(baseline, results, count, threshold);
+        if (ch != 0)
+            return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,693 @@
+#include "interpreter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER     /* WIN32 */
+#include <getopt.h>
+#else               /* POSIX */
+#include <unistd.h>
+#endif
+
+/* Checks the interpreter's engines against one another. Each program is run
+   twice in lockstep: by the reference engine (F_REFERENCE: every step of
+   every cursor executed by the plain loop, with cursors in identical
+   states kept apart), and by the candidate, which is the engine used by
+   default, optionally with a tiled field (-T) and threads (-t). Every
+   `every' steps (-e), a hash of the field, the cursor list (sorted, with
+   identical cursors merged) and the input and output so far is compared,
+   and folded into a rolling hash of the whole trace.
+
+   When the states differ, both engines are run again from the last state
+   that matched, one more step at a time, to find the first step after
+   which they differ. The program and a diff of both states at that step
+   are written to stdout, and the exit status is 1.
+
+   Without arguments, `count' (-g) random programs are checked, generated
+   from the seeds seed, seed + 1, ... (-s); the seed of a failing program
+   reproduces it on its own with -g 1. Otherwise the given program is
+   checked, with standard input as its input (in clear mode with -*, as by
+   the interpreter). Programs are run for at most `max_steps' steps (-n),
+   or until they have more than `max_cursors' cursors (-m).
+
+   With -j, both engines also record changes to the field (F_JOURNAL), and
+   every cell that changed between two comparisons must be among the cells
+   reported by interpreter_changes_since(). As the reference engine does
+   not compile traces, this checks the journal with and without them.
+
+   Usage: refcheck [-*jTv] [-t threads] [-e every] [-n steps] [-m cursors]
+                   [-s seed] [-g count] [-c x] [program.ref] */
+
+#define MAX_INPUT   (1 << 20)
+#define MAX_LISTED  16
+
+/* A state of an interpreter, as compared */
+struct State {
+    long long steps, hash;
+    struct Size size;
+    struct Cursor *cursors;
+    int num_cursors;
+    int in_offset, out_len;
+};
+
+/* An interpreter with its position in the input and the output so far */
+struct Engine {
+    struct Interpreter *i;
+    int in_offset, out_len, out_cap;
+    char *out;
+};
+
+/* Instructions for random programs, some more often than others: moving
+   the data pointer up kills cursors near the top, and mirrors keep them
+   from running off the field. */
+static const char instructions[] = "~+-?!>>vv<<^XX//\\\\||#@@Y";
+#define NUM_INSTRUCTIONS ((int)sizeof(instructions) - 1)
+
+static int cand_flags = F_NONE, threads = 1, verbose = 0, journal = 0;
+static int every = 1000, max_cursors = 4096;
+static long long max_steps = 10000;
+
+static const char *input;
+static int input_len;
+
+static unsigned long long fnv(unsigned long long h, const void *data,
+                              size_t size)
+{
+    const unsigned char *p = data;
+
+    while (size-- > 0)
+        h = (h ^ *p++)*1099511628211ULL;
+    return h;
+}
+
+/* Random numbers, the same on every platform for a given seed */
+static unsigned long long rng;
+
+static int rand_int(int n)
+{
+    unsigned long long z;
+
+    /* splitmix64 */
+    z = rng += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return (int)((z ^ (z >> 31)) % n);
+}
+
+/* Generates a random program, with random input. The field mostly holds
+   instructions and data values, with some rows of no-ops and counting
+   loops to give skip_nops() and skip_loop() something to do. A loop is
+   entered over the #, adds or subtracts the cell right of the data cell
+   to it, and is left over the @ once the data cell is zero:
+
+       #/~>-<..\
+        \@     /
+
+   The program may start by moving the data pointer to a row of odd values
+   for loops to count, and run down the third column into each loop in
+   turn. The bottom row may be a barrier of |'s, and there are no mirrors on
+   the top row, so that not every cursor soon runs off the field. */
+static struct Interpreter *generate(unsigned long long seed, char *in,
+                                    int *in_len)
+{
+    struct Interpreter *i;
+    struct Size size;
+    int r, c, n, k, ch, data_row;
+
+    rng = seed;
+    i = interpreter_create();
+    if (!i)
+        return NULL;
+    data_row = rand_int(2);
+    size.width = data_row ? 12 + rand_int(20) : 2 + rand_int(30);
+    size.height = data_row ? 4 + rand_int(13) : 1 + rand_int(16);
+    interpreter_resize(i, size);
+    for (r = 0; r < size.height; ++r)
+    {
+        n = rand_int(8);
+        for (c = 0; c < size.width; ++c)
+        {
+            if (data_row && r == 1)
+                ch = 2*rand_int(8) + 1;
+            else
+            if (n == 0)             /* row of no-ops */
+                ch = rand_int(8) ? 0 : instructions[rand_int(NUM_INSTRUCTIONS)];
+            else
+            if (rand_int(3) == 0)   /* data */
+                ch = rand_int(4) == 0 ? rand_int(256) : rand_int(4);
+            else
+                ch = instructions[rand_int(NUM_INSTRUCTIONS)];
+            if (r == 0 && (ch == '/' || ch == '\\' || ch == '|'))
+                ch = '~';
+            if (r > 0 && r == size.height - 1 && n < 4)
+                ch = '|';
+            interpreter_set(i, r, c, (char)ch);
+        }
+    }
+    if (data_row)
+    {
+        interpreter_set(i, 0, 0, '~');
+        interpreter_set(i, 0, 1, 'v');
+        interpreter_set(i, 0, 2, '\\');
+        for (r = 2; r < size.height; ++r)
+            interpreter_set(i, r, 2, 0);
+    }
+    for (r = 1 + data_row; r + 1 < size.height; ++r)
+    {
+        k = rand_int(3);
+        if (rand_int(4 - 2*data_row) != 0 || size.width < 10 + k)
+            continue;
+        c = data_row ? 4 : 1 + rand_int(size.width - 9 - k);
+        if (data_row)
+        {
+            interpreter_set(i, r, 2, '\\');
+            interpreter_set(i, r + 1, 2, '/');
+        }
+        interpreter_set(i, r, c - 1, '#');
+        interpreter_set(i, r, c, '/');
+        interpreter_set(i, r + 1, c, '\\');
+        interpreter_set(i, r + 1, c + 1, '@');
+        for (n = 1; n < 6 + k; ++n)
+        {
+            interpreter_set(i, r, c + n, "~>-<~~~"[n - 1]);
+            if (n > 1)
+                interpreter_set(i, r + 1, c + n, 0);
+        }
+        if (rand_int(2))
+            interpreter_set(i, r, c + 3, '+');
+        if (k > 1)
+            interpreter_set(i, r, c + 6, 'X');
+        interpreter_set(i, r, c + 5 + k, '\\');
+        interpreter_set(i, r + 1, c + 5 + k, '/');
+        r += 1;
+    }
+    if (rand_int(2))
+        interpreter_set_flags(i, F_CLEAR_MODE);
+    *in_len = rand_int(4) == 0 ? 0 : rand_int(64);
+    for (n = 0; n < *in_len; ++n)
+        in[n] = (char)rand_int(256);
+    return i;
+}
+
+static int compare_cursors(const void *a, const void *b)
+{
+    const struct Cursor *p = a, *q = b;
+
+    if (p->ir != q->ir) return p->ir < q->ir ? -1 : 1;
+    if (p->ic != q->ic) return p->ic < q->ic ? -1 : 1;
+    if (p->dr != q->dr) return p->dr < q->dr ? -1 : 1;
+    if (p->dc != q->dc) return p->dc < q->dc ? -1 : 1;
+    if (p->id != q->id) return p->id < q->id ? -1 : 1;
+    return p->dm - q->dm;
+}
+
+/* Takes the state of an engine; s->cursors must be freed by the caller. */
+static int get_state(struct Engine *e, struct State *s)
+{
+    struct Interpreter *i = e->i;
+    unsigned long long h = 14695981039346656037ULL;
+    int r, c, n, m;
+    char ch;
+
+    s->steps = i->steps;
+    s->size = interpreter_size(i);
+    s->in_offset = e->in_offset;
+    s->out_len = e->out_len;
+    s->cursors = malloc((i->num_cursors + 1)*sizeof(struct Cursor));
+    if (!s->cursors)
+        return 0;
+    memcpy(s->cursors, i->cursors, i->num_cursors*sizeof(struct Cursor));
+    qsort(s->cursors, i->num_cursors, sizeof(struct Cursor), compare_cursors);
+    for (n = m = 0; n < i->num_cursors; ++n)
+    {
+        if (m > 0 && compare_cursors(&s->cursors[m - 1], &s->cursors[n]) == 0)
+            s->cursors[m - 1].weight += s->cursors[n].weight;
+        else
+            s->cursors[m++] = s->cursors[n];
+    }
+    s->num_cursors = m;
+
+    h = fnv(h, &s->steps, sizeof(s->steps));
+    h = fnv(h, &s->size, sizeof(s->size));
+    for (r = 0; r < s->size.height; ++r)
+        for (c = 0; c < s->size.width; ++c)
+        {
+            ch = interpreter_get(i, r, c);
+            h = fnv(h, &ch, 1);
+        }
+    for (n = 0; n < s->num_cursors; ++n)
+    {
+        h = fnv(h, &s->cursors[n].ir, sizeof(int));
+        h = fnv(h, &s->cursors[n].ic, sizeof(int));
+        h = fnv(h, &s->cursors[n].dr, sizeof(int));
+        h = fnv(h, &s->cursors[n].dc, sizeof(int));
+        h = fnv(h, &s->cursors[n].id, 1);
+        h = fnv(h, &s->cursors[n].dm, 1);
+        h = fnv(h, &s->cursors[n].weight, 1);
+    }
+    h = fnv(h, &s->in_offset, sizeof(int));
+    h = fnv(h, e->out, e->out_len);
+    s->hash = (long long)h;
+    return 1;
+}
+
+/* Makes room for n more bytes of output. */
+static int reserve(struct Engine *e, int n)
+{
+    char *out;
+    int cap = e->out_cap ? e->out_cap : 4096;
+
+    while (cap - e->out_len < n)
+        cap *= 2;
+    if (cap == e->out_cap)
+        return 1;
+    out = realloc(e->out, cap);
+    if (!out)
+        return 0;
+    e->out = out;
+    e->out_cap = cap;
+    return 1;
+}
+
+/* Runs up to n steps. Input is passed until it has all been read, and is
+   at end of file from then on. */
+static int advance(struct Engine *e, int n)
+{
+    const char *in = e->in_offset < input_len ? input + e->in_offset : NULL;
+    int consumed, produced;
+
+    if (!reserve(e, n) ||
+        interpreter_run(e->i, n, in, input_len - e->in_offset,
+                        e->out + e->out_len, n, &consumed, &produced) == I_ERROR)
+        return 0;
+    if (e->in_offset < input_len)
+        e->in_offset += consumed;
+    e->out_len += produced;
+    return 1;
+}
+
+/* Runs an engine until it has executed `steps' steps in all, or until the
+   program ends (a run stops early after the last byte of input). With
+   `stepwise', the engine is run one step at a time, and stopped as soon as
+   it has more than max_cursors cursors. */
+static int run_until(struct Engine *e, long long steps, int stepwise)
+{
+    long long left;
+
+    while ((left = steps - e->i->steps) > 0 && e->i->num_cursors > 0)
+    {
+        if (stepwise && e->i->num_cursors > max_cursors)
+            break;
+        if (!advance(e, stepwise ? 1 : (int)left))
+            return 0;
+    }
+    return 1;
+}
+
+/* Starts an engine with the given flags on a copy of `from', at the input
+   and output position of `at' if given. */
+static int start(struct Engine *e, struct Interpreter *from, int flags,
+                 const struct Engine *at)
+{
+    e->i = interpreter_clone(from);
+    if (!e->i)
+        return 0;
+    interpreter_set_flags(e->i, flags);
+    interpreter_set_threads(e->i, flags & F_REFERENCE ? 1 : threads);
+    e->in_offset = e->out_len = 0;
+    if (at)
+    {
+        if (!reserve(e, at->out_len))
+            return 0;
+        e->in_offset = at->in_offset;
+        e->out_len = at->out_len;
+        memcpy(e->out, at->out, at->out_len);
+    }
+    return 1;
+}
+
+/* Cells reported by interpreter_changes_since() */
+struct Changes {
+    struct Size size;
+    char *marked;               /* row-major */
+};
+
+static void mark_change(void *arg, int row, int col)
+{
+    struct Changes *ch = arg;
+
+    if (row >= ch->size.height)
+        return;
+    if (col < 0)
+        memset(ch->marked + row*ch->size.width, 1, ch->size.width);
+    else
+    if (col < ch->size.width)
+        ch->marked[row*ch->size.width + col] = 1;
+}
+
+/* Checks that the journal of an engine reported every cell that changed
+   since `from', a copy of the engine taken at journal epoch `epoch', and
+   lists the cells it missed. Returns their number, or -1 on failure. */
+static int check_journal(struct Interpreter *i, struct Interpreter *from,
+                         long long epoch, const char *name,
+                         const char *engine)
+{
+    struct Changes ch;
+    struct Size old = interpreter_size(from);
+    int r, c, missed = 0;
+    char x, y;
+
+    ch.size = interpreter_size(i);
+    ch.marked = calloc((size_t)ch.size.width*ch.size.height + 1, 1);
+    if (!ch.marked)
+        return -1;
+    if (interpreter_changes_since(i, epoch, mark_change, &ch) < 0)
+    {
+        free(ch.marked);
+        return 0;
+    }
+    for (r = 0; r < ch.size.height; ++r)
+        for (c = 0; c < ch.size.width; ++c)
+        {
+            x = r < old.height && c < old.width ? interpreter_get(from, r, c)
+                                                : 0;
+            y = interpreter_get(i, r, c);
+            if (x == y || ch.marked[r*ch.size.width + c])
+                continue;
+            if (missed == 0)
+                printf("%s: the %s engine did not journal all changes "
+                       "between steps %lld and %lld\n", name, engine,
+                       from->steps, i->steps);
+            if (missed++ < MAX_LISTED)
+                printf("  cell (%d,%d): %d -> %d\n", r, c,
+                       (unsigned char)x, (unsigned char)y);
+        }
+    if (missed > MAX_LISTED)
+        printf("  ... %d changed cells were not reported\n", missed);
+    free(ch.marked);
+    return missed;
+}
+
+static void print_cursor(const struct Cursor *c)
+{
+    printf("    ip (%d,%d) %c  dp (%d,%d)  mode %c  weight %d\n",
+           c->ir, c->ic, ">v<^"[c->id], c->dr, c->dc, "~+-?!."[c->dm],
+           c->weight ? c->weight : 256);
+}
+
+static void print_field(struct Interpreter *i)
+{
+    struct Size size = interpreter_size(i);
+    int r, c;
+    unsigned char ch;
+
+    for (r = 0; r < size.height; ++r)
+    {
+        printf("    |");
+        for (c = 0; c < size.width; ++c)
+        {
+            ch = (unsigned char)interpreter_get(i, r, c);
+            putchar(ch == 0 ? ' ' : ch >= 32 && ch < 127 ? ch : '.');
+        }
+        printf("|\n");
+    }
+}
+
+static void print_diff(struct Engine *ref, const struct State *s,
+                       struct Engine *cand, const struct State *t)
+{
+    int r, c, n, listed = 0;
+    char x, y;
+
+    printf("  steps: %lld / %lld\n", s->steps, t->steps);
+    if (s->size.width != t->size.width || s->size.height != t->size.height)
+        printf("  size: %dx%d / %dx%d\n", s->size.width, s->size.height,
+               t->size.width, t->size.height);
+    for (r = 0; r < s->size.height && r < t->size.height; ++r)
+        for (c = 0; c < s->size.width && c < t->size.width; ++c)
+        {
+            x = interpreter_get(ref->i, r, c);
+            y = interpreter_get(cand->i, r, c);
+            if (x != y && listed++ < MAX_LISTED)
+                printf("  cell (%d,%d): %d / %d\n", r, c,
+                       (unsigned char)x, (unsigned char)y);
+        }
+    if (listed > MAX_LISTED)
+        printf("  ... %d cells differ\n", listed);
+    if (s->in_offset != t->in_offset)
+        printf("  input read: %d / %d bytes\n", s->in_offset, t->in_offset);
+    for (n = 0; n < s->out_len && n < t->out_len &&
+                ref->out[n] == cand->out[n]; ++n) { }
+    if (n < s->out_len || n < t->out_len)
+        printf("  output: %d / %d bytes, first difference at byte %d\n",
+               s->out_len, t->out_len, n);
+    for (n = 0; n < s->num_cursors || n < t->num_cursors; ++n)
+        if (n >= s->num_cursors || n >= t->num_cursors ||
+            compare_cursors(&s->cursors[n], &t->cursors[n]) != 0 ||
+            s->cursors[n].weight != t->cursors[n].weight)
+            break;
+    if (n < s->num_cursors || n < t->num_cursors)
+    {
+        printf("  reference cursors (%d):\n", s->num_cursors);
+        for (r = n; r < s->num_cursors && r < n + MAX_LISTED; ++r)
+            print_cursor(&s->cursors[r]);
+        printf("  candidate cursors (%d):\n", t->num_cursors);
+        for (r = n; r < t->num_cursors && r < n + MAX_LISTED; ++r)
+            print_cursor(&t->cursors[r]);
+        if (n > 0)
+            printf("  (the first %d cursors are equal)\n", n);
+    }
+}
+
+/* Runs the engines from the checkpoints `ref0' and `cand0' for 1, 2, ...
+   up to n steps, and reports the first step after which they differ. */
+static void narrow(struct Engine *ref0, struct Engine *cand0, int n)
+{
+    struct Engine ref, cand;
+    struct State s, t;
+    int k, found = 0;
+
+    memset(&ref, 0, sizeof(ref));
+    memset(&cand, 0, sizeof(cand));
+    for (k = 1; k <= n && !found; ++k)
+    {
+        if (!start(&ref, ref0->i, interpreter_get_flags(ref0->i), ref0) ||
+            !start(&cand, cand0->i, interpreter_get_flags(cand0->i), cand0))
+            break;
+        if (run_until(&ref, ref0->i->steps + k, 0) &&
+            run_until(&cand, ref0->i->steps + k, 0) &&
+            get_state(&ref, &s) && get_state(&cand, &t))
+        {
+            if (s.hash != t.hash)
+            {
+                printf("First difference after step %lld (reference / "
+                       "candidate):\n", s.steps);
+                print_diff(&ref, &s, &cand, &t);
+                found = 1;
+            }
+            free(s.cursors);
+            free(t.cursors);
+        }
+        interpreter_destroy(ref.i);
+        interpreter_destroy(cand.i);
+    }
+    if (!found)
+        printf("The difference did not reappear when run again from step "
+               "%lld\n", ref0->i->steps);
+    free(ref.out);
+    free(cand.out);
+}
+
+/* Checks a program (listed if the engines differ and it was generated).
+   Returns 1 if the engines agree, 0 if they do not, and -1 on failure. */
+static int check(struct Interpreter *prog, const char *name, int generated)
+{
+    struct Engine ref = { 0 }, cand = { 0 }, ref0 = { 0 }, cand0 = { 0 };
+    struct State s, t;
+    unsigned long long trace = 14695981039346656037ULL;
+    long long ref_epoch, cand_epoch;
+    int n, missed, result = -1;
+    int flags = interpreter_get_flags(prog) & F_CLEAR_MODE;
+
+    if (journal)
+        flags |= F_JOURNAL;
+
+    if (!start(&ref, prog, F_REFERENCE | flags, NULL) ||
+        !start(&cand, prog, cand_flags | flags, NULL))
+        goto done;
+    for (;;)
+    {
+        interpreter_destroy(ref0.i);
+        interpreter_destroy(cand0.i);
+        ref0.i = cand0.i = NULL;
+        if (!start(&ref0, ref.i, F_REFERENCE | flags, &ref) ||
+            !start(&cand0, cand.i, cand_flags | flags, &cand))
+            goto done;
+        ref_epoch = interpreter_changes_since(ref.i, 0, NULL, NULL);
+        cand_epoch = interpreter_changes_since(cand.i, 0, NULL, NULL);
+        n = every;
+        if (n > max_steps - ref.i->steps)
+            n = (int)(max_steps - ref.i->steps);
+        if (!run_until(&ref, ref.i->steps + n, 1) ||
+            !run_until(&cand, ref.i->steps, 0))
+        {
+            fprintf(stderr, "%s: the interpreter failed\n", name);
+            goto done;
+        }
+        if (journal)
+        {
+            missed = check_journal(ref.i, ref0.i, ref_epoch, name,
+                                   "reference");
+            n = check_journal(cand.i, cand0.i, cand_epoch, name,
+                              "candidate");
+            if (missed < 0 || n < 0)
+                goto done;
+            if (missed + n > 0)
+            {
+                if (generated)
+                    print_field(prog);
+                result = 0;
+                goto done;
+            }
+        }
+        if (!get_state(&ref, &s) || !get_state(&cand, &t))
+            goto done;
+        trace = (trace ^ (unsigned long long)s.hash)*1099511628211ULL;
+        free(s.cursors);
+        free(t.cursors);
+        if (s.hash != t.hash)
+        {
+            printf("%s: the engines differ between steps %lld and %lld\n",
+                   name, ref0.i->steps, s.steps);
+            printf("  %d bytes of input%s\n", input_len,
+                   flags ? ", clear mode" : "");
+            if (generated)
+                print_field(prog);
+            narrow(&ref0, &cand0, (int)(s.steps - ref0.i->steps));
+            result = 0;
+            goto done;
+        }
+        if (ref.i->num_cursors == 0 || ref.i->steps >= max_steps ||
+            ref.i->num_cursors > max_cursors)
+            break;
+    }
+    if (verbose)
+        printf("%s: %lld steps, %d cursors, %d bytes in, %d bytes out, "
+               "trace %016llx\n", name, ref.i->steps, ref.i->num_cursors,
+               ref.in_offset, ref.out_len, trace);
+    result = 1;
+
+done:
+    interpreter_destroy(ref.i);
+    interpreter_destroy(cand.i);
+    interpreter_destroy(ref0.i);
+    interpreter_destroy(cand0.i);
+    free(ref.out);
+    free(cand.out);
+    free(ref0.out);
+    free(cand0.out);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    struct Interpreter *prog;
+    static char buf[MAX_INPUT];
+    char name[64], nul = 0;
+    unsigned long long seed = 1;
+    int ch, n, count = 1000, failed = 0, result, clear_mode = 0;
+
+    while ((ch = getopt(argc, argv, "*c:e:g:jm:n:s:t:Tv")) != -1)
+    {
+        switch (ch)
+        {
+        case '*':
+            clear_mode = 1;
+            break;
+        case 'c':
+            if (strlen(optarg) != 1)
+            {
+                printf("-c expects a single character, not \"%s\"\n", optarg);
+                return 1;
+            }
+            nul = *optarg;
+            break;
+        case 'e':
+            every = atoi(optarg);
+            if (every < 1)
+            {
+                printf("-e expects a positive number of steps\n");
+                return 1;
+            }
+            break;
+        case 'g':
+            count = atoi(optarg);
+            break;
+        case 'j':
+            journal = 1;
+            break;
+        case 'm':
+            max_cursors = atoi(optarg);
+            break;
+        case 'n':
+            max_steps = atoll(optarg);
+            if (max_steps < 1)
+            {
+                printf("-n expects a positive number of steps\n");
+                return 1;
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'T':
+            cand_flags |= F_TILED;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        }
+    }
+    if (argc - optind > 1)
+    {
+        printf("Usage: %s [-*jTv] [-t threads] [-e every] [-n steps] "
+               "[-m cursors] [-s seed] [-g count] [-c x] [program]\n",
+               argv[0]);
+        return 1;
+    }
+    input = buf;
+
+    if (argc - optind == 1)
+    {
+        prog = interpreter_from_source(argv[optind], nul);
+        if (!prog)
+        {
+            fprintf(stderr, "Could not open %s\n", argv[optind]);
+            return 1;
+        }
+        if (clear_mode)
+            interpreter_set_flags(prog, F_CLEAR_MODE);
+        input_len = (int)fread(buf, 1, sizeof(buf), stdin);
+        result = check(prog, argv[optind], 0);
+        interpreter_destroy(prog);
+        return result == 1 ? 0 : 1;
+    }
+
+    for (n = 0; n < count; ++n)
+    {
+        prog = generate(seed + n, buf, &input_len);
+        if (!prog)
+            return 1;
+        sprintf(name, "seed %llu", seed + n);
+        result = check(prog, name, 1);
+        interpreter_destroy(prog);
+        if (result < 0)
+            return 1;
+        failed += !result;
+    }
+    printf("%d of %d programs differ\n", failed, count);
+    return failed > 0;
+}
@@ -0,0 +1,243 @@
+#include "interpreter.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER     /* WIN32 */
+#include <getopt.h>
+#else               /* POSIX */
+#include <unistd.h>
+#endif
+
+/* Renders a profile written by `interpreter -P' as a listing of the
+   program, annotated with the execution counts of every row and a heat
+   line for the cells in it, and optionally as an image with a pixel (or a
+   block of zoom x zoom pixels) per cell.
+
+   In the listing, the "ip" line under a row shows how often each cell was
+   executed, and the "dp" line how often it was read or written by a data
+   pointer, as digits 0-9 on a logarithmic scale relative to the busiest
+   cell (blank for cells never reached). The PGM image shows the execution
+   counts in grey; the PPM image shows them in red, with data accesses in
+   green.
+
+   Usage: refprof [-cx] [-g heat.pgm] [-p heat.ppm] [-z zoom]
+                  prog.ref profile.out */
+
+static struct Interpreter *prog;
+static struct Size size;                /* of the profile */
+static long long steps;
+static struct CellCounts *cells, *rows;
+static long long max_visits, max_access;
+
+static long long visits(const struct CellCounts *k)
+{
+    return k->visits[0] + k->visits[1] + k->visits[2] + k->visits[3];
+}
+
+/* Scales a count to 0..max, logarithmically relative to `top'. */
+static int heat(long long count, long long top, int max)
+{
+    if (count <= 0 || top <= 0)
+        return 0;
+    return (int)(max*log(1.0 + count)/log(1.0 + top) + 0.5);
+}
+
+static int read_profile(const char *filepath)
+{
+    struct CellCounts k;
+    FILE *fp;
+    char word[16];
+    int r, c, version;
+
+    fp = fopen(filepath, "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "refunge-profile %d size %d %d steps %lld",
+               &version, &size.width, &size.height, &steps) != 4 ||
+        version != 1 || size.width < 1 || size.height < 0)
+    {
+        fclose(fp);
+        return 0;
+    }
+    cells = calloc((size_t)size.width*size.height + 1,
+                   sizeof(struct CellCounts));
+    rows = calloc(size.height + 1, sizeof(struct CellCounts));
+    if (!cells || !rows)
+    {
+        fclose(fp);
+        return 0;
+    }
+    while (fscanf(fp, "%15s", word) == 1)
+    {
+        c = -1;
+        if ( (strcmp(word, "row") != 0 || fscanf(fp, "%d", &r) != 1) &&
+             (strcmp(word, "cell") != 0 || fscanf(fp, "%d %d", &r, &c) != 2) )
+            break;
+        if (fscanf(fp, "%lld %lld %lld %lld %lld %lld",
+                   &k.visits[0], &k.visits[1], &k.visits[2], &k.visits[3],
+                   &k.reads, &k.writes) != 6 ||
+            r < 0 || r >= size.height || c >= size.width)
+            break;
+        if (c < 0)
+            rows[r] = k;
+        else
+        {
+            cells[r*size.width + c] = k;
+            if (visits(&k) > max_visits)
+                max_visits = visits(&k);
+            if (k.reads + k.writes > max_access)
+                max_access = k.reads + k.writes;
+        }
+    }
+    r = feof(fp);
+    fclose(fp);
+    return r;
+}
+
+/* Writes a heat line for row r: execution counts, or data accesses. */
+static void print_heat(int r, int data)
+{
+    const struct CellCounts *k;
+    long long count;
+    int c;
+
+    printf("%48s |", data ? "dp" : "ip");
+    for (c = 0; c < size.width; ++c)
+    {
+        k = &cells[r*size.width + c];
+        count = data ? k->reads + k->writes : visits(k);
+        if (count == 0)
+            putchar(' ');
+        else
+            putchar('0' + heat(count, data ? max_access : max_visits, 9));
+    }
+    printf("|\n");
+}
+
+static void print_listing(const char *filepath)
+{
+    struct Size field = interpreter_size(prog);
+    const struct CellCounts *k;
+    int r, c, ch;
+
+    printf("Profile of %s: %lld steps\n\n", filepath, steps);
+    printf("%6s %12s %12s %12s\n", "row", "visits", "reads", "writes");
+    for (r = 0; r < size.height || r < field.height; ++r)
+    {
+        k = r < size.height ? &rows[r] : NULL;
+        if (k && (visits(k) || k->reads || k->writes))
+            printf("%6d %12lld %12lld %12lld", r, visits(k), k->reads,
+                   k->writes);
+        else
+            printf("%6d %12s %12s %12s", r, "", "", "");
+        printf("    |");
+        for (c = 0; c < size.width; ++c)
+        {
+            ch = r < field.height && c < field.width
+                 ? (unsigned char)interpreter_get(prog, r, c) : 0;
+            putchar(ch == 0 ? ' ' : ch >= 32 && ch < 127 ? ch : '.');
+        }
+        printf("|\n");
+        if (k && visits(k))
+            print_heat(r, 0);
+        if (k && (k->reads || k->writes))
+            print_heat(r, 1);
+    }
+}
+
+/* Writes a binary PGM (grey) or PPM (colour) image of the profile. */
+static int write_image(const char *filepath, int colour, int zoom)
+{
+    const struct CellCounts *k;
+    FILE *fp;
+    int r, c, n, ok;
+
+    fp = fopen(filepath, "wb");
+    if (!fp)
+        return 0;
+    fprintf(fp, "P%d\n%d %d\n255\n", colour ? 6 : 5,
+            size.width*zoom, size.height*zoom);
+    for (r = 0; r < size.height*zoom; ++r)
+        for (c = 0; c < size.width*zoom; ++c)
+        {
+            k = &cells[r/zoom*size.width + c/zoom];
+            n = heat(visits(k), max_visits, 255);
+            putc(n, fp);
+            if (colour)
+            {
+                putc(heat(k->reads + k->writes, max_access, 255), fp);
+                putc(0, fp);
+            }
+        }
+    ok = !ferror(fp);
+    return fclose(fp) == 0 && ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *pgm = NULL, *ppm = NULL;
+    char nul = 0, ch;
+    int zoom = 1;
+
+    while ((ch = getopt(argc, argv, "c:g:p:z:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c':
+            if (strlen(optarg) != 1)
+            {
+                printf("-c expects a single character, not \"%s\"\n", optarg);
+                return 1;
+            }
+            nul = *optarg;
+            break;
+        case 'g':
+            pgm = optarg;
+            break;
+        case 'p':
+            ppm = optarg;
+            break;
+        case 'z':
+            zoom = atoi(optarg);
+            if (zoom < 1)
+            {
+                printf("-z expects a positive number of pixels per cell\n");
+                return 1;
+            }
+            break;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        printf("Usage: %s [-cx] [-g heat.pgm] [-p heat.ppm] [-z zoom] "
+               "<program> <profile>\n", argv[0]);
+        return argc != 1;
+    }
+
+    prog = interpreter_from_source(argv[optind], nul);
+    if (!prog)
+    {
+        fprintf(stderr, "Could not open %s\n", argv[optind]);
+        return 1;
+    }
+    if (!read_profile(argv[optind + 1]))
+    {
+        fprintf(stderr, "Could not read profile %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    print_listing(argv[optind]);
+    if (pgm && !write_image(pgm, 0, zoom))
+    {
+        fprintf(stderr, "Could not write %s\n", pgm);
+        return 1;
+    }
+    if (ppm && !write_image(ppm, 1, zoom))
+    {
+        fprintf(stderr, "Could not write %s\n", ppm);
+        return 1;
+    }
+    return 0;
+}